@@ -0,0 +1,146 @@
+#include "DBusUtilsAsync.hpp"
+
+bool UDBus::makeRequestKey(const Message& message, std::string& key) noexcept
+{
+    // The marshalled message contains the destination, path, interface and member header fields as well as the body.
+    // Marshalling an unsent message does not lock it, so it can still be sent afterwards
+    char* data = nullptr;
+    int len = 0;
+    if (!message.marshal(&data, &len))
+        return false;
+    key.assign(data, len);
+    dbus_free(data);
+    return true;
+}
+
+UDBus::CallCoalescer::CallCoalescer(const Connection& connection) noexcept
+{
+    this->connection = &connection;
+}
+
+void UDBus::CallCoalescer::fillError(const Message& reply, Error& error) noexcept
+{
+    if (!reply.is_valid())
+        error.set(DBUS_ERROR_DISCONNECTED, "The call could not be completed because the connection is closed");
+    else if (reply.get_type() == DBUS_MESSAGE_TYPE_ERROR)
+        dbus_set_error_from_message(error, reply);
+}
+
+void UDBus::CallCoalescer::complete(const std::shared_ptr<Flight>& flight) noexcept
+{
+    std::vector<ReplyContinuation> continuations;
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (flight->bDone)
+            return;
+        flight->bDone = true;
+        if (static_cast<DBusPendingCall*>(flight->pending) != nullptr)
+            flight->reply.pending_call_steal_reply(flight->pending);
+        flights.erase(flight->key);
+        continuations = std::move(flight->continuations);
+    }
+
+    for (auto& a : continuations)
+    {
+        Message reply;
+        if (flight->reply.is_valid())
+            reply.ref(flight->reply);
+        Error error;
+        fillError(reply, error);
+        a(reply, error);
+    }
+}
+
+void UDBus::CallCoalescer::notify(DBusPendingCall*, void* data) noexcept
+{
+    const auto* notifyData = static_cast<NotifyData*>(data);
+    // Flights stay in the table until they complete, so this only fails for flights that were already completed
+    if (const auto flight = notifyData->flight.lock(); flight != nullptr)
+        notifyData->coalescer->complete(flight);
+}
+
+void UDBus::CallCoalescer::freeNotifyData(void* data) noexcept
+{
+    delete static_cast<NotifyData*>(data);
+}
+
+UDBus::Message UDBus::CallCoalescer::send_with_reply_and_block(Message& message, const int timeout_milliseconds, Error& error) noexcept
+{
+    std::string key;
+    if (!makeRequestKey(message, key))
+    {
+        error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to build the request key");
+        return Message{};
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    std::shared_ptr<Flight> flight;
+    if (const auto it = flights.find(key); it != flights.end())
+        flight = it->second;
+    else
+    {
+        flight = std::make_shared<Flight>();
+        flight->key = std::move(key);
+
+        // The call is sent while holding the lock, so no other thread can join the flight before it is known whether
+        // it was actually sent
+        if (!connection->send_with_reply(message, flight->pending, timeout_milliseconds) || static_cast<DBusPendingCall*>(flight->pending) == nullptr)
+        {
+            error.set(DBUS_ERROR_DISCONNECTED, "The call could not be sent");
+            return Message{};
+        }
+        flights.emplace(flight->key, flight);
+    }
+    lock.unlock();
+
+    // Every waiter blocks on the shared pending call itself instead of waiting for another thread to complete it.
+    // This way, joining a call made with send_with_reply does not deadlock if nobody else dispatches the connection
+    flight->pending.block();
+    complete(flight);
+
+    Message reply;
+    if (flight->reply.is_valid())
+        reply.ref(flight->reply);
+    fillError(reply, error);
+    return reply;
+}
+
+udbus_bool_t UDBus::CallCoalescer::send_with_reply(Message& message, ReplyContinuation continuation, const int timeout_milliseconds) noexcept
+{
+    std::string key;
+    if (!makeRequestKey(message, key))
+        return false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (const auto it = flights.find(key); it != flights.end())
+    {
+        it->second->continuations.push_back(std::move(continuation));
+        return true;
+    }
+
+    auto flight = std::make_shared<Flight>();
+    flight->key = std::move(key);
+    if (!connection->send_with_reply(message, flight->pending, timeout_milliseconds) || static_cast<DBusPendingCall*>(flight->pending) == nullptr)
+        return false;
+    flight->continuations.push_back(std::move(continuation));
+    flights.emplace(flight->key, flight);
+    lock.unlock();
+
+    // Set the notify function without holding the lock, as it may complete the flight right away. If the reply
+    // arrived before the notify function was set, complete the flight here instead
+    auto* data = new NotifyData{ this, flight };
+    if (!flight->pending.set_notify(notify, data, freeNotifyData))
+    {
+        delete data;
+        complete(flight);
+    }
+    else if (flight->pending.get_completed())
+        complete(flight);
+    return true;
+}
+
+size_t UDBus::CallCoalescer::in_flight() noexcept
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    return flights.size();
+}
@@ -0,0 +1,49 @@
+#include "DBusUtils.hpp"
+#ifdef UDBUS_CODEC_COUNTERS
+#include <cstdlib>
+#include <new>
+
+thread_local UDBus::CodecStats UDBus::codecCounters{};
+
+// Counting allocations needs the global operator new, so building with UDBUS_CODEC_COUNTERS replaces it for the whole
+// process. It only adds a thread local increment on top of malloc, which is what the default one uses as well
+void* operator new(const std::size_t size)
+{
+    UDBus::codecCounters.allocations++;
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// Over-aligned types use these instead. aligned_alloc wants a size that is a multiple of the alignment
+void* operator new(const std::size_t size, const std::align_val_t alignment)
+{
+    UDBus::codecCounters.allocations++;
+    const auto align = static_cast<std::size_t>(alignment);
+    void* ptr = std::aligned_alloc(align, size == 0 ? align : (size + align - 1) & ~(align - 1));
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+#endif
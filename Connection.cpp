@@ -1,4 +1,6 @@
-#include "DBusUtils.hpp"
+#include "DBusUtilsStats.hpp"
+#include <chrono>
+#include <pthread.h>
 
 UDBus::Connection::~Connection() noexcept
 {
@@ -9,7 +11,17 @@ UDBus::Connection::Connection(Connection&& other) noexcept
 {
     connection = other.connection;
     bPrivate = other.bPrivate;
+    backpressure = std::move(other.backpressure);
+    busyPollState = std::move(other.busyPollState);
+    stats = other.stats;
+    connectionStats = other.connectionStats;
+    flightRecorder = other.flightRecorder;
+    pcapWriter = other.pcapWriter;
     other.connection = nullptr;
+    other.stats = nullptr;
+    other.connectionStats = nullptr;
+    other.flightRecorder = nullptr;
+    other.pcapWriter = nullptr;
     other.bPrivate = false;
 }
 
@@ -20,7 +32,17 @@ UDBus::Connection& UDBus::Connection::operator=(Connection&& other) noexcept
         unref();
         connection = other.connection;
         bPrivate = other.bPrivate;
+        backpressure = std::move(other.backpressure);
+        busyPollState = std::move(other.busyPollState);
+        stats = other.stats;
+        connectionStats = other.connectionStats;
+        flightRecorder = other.flightRecorder;
+        pcapWriter = other.pcapWriter;
         other.connection = nullptr;
+        other.stats = nullptr;
+        other.connectionStats = nullptr;
+        other.flightRecorder = nullptr;
+        other.pcapWriter = nullptr;
         other.bPrivate = false;
     }
     return *this;
@@ -99,17 +121,151 @@ void UDBus::Connection::flush() const noexcept
 
 udbus_bool_t UDBus::Connection::send(UDBus::Message& message, dbus_uint32_t* client_serial) const noexcept
 {
-    return dbus_connection_send(connection, message, client_serial);
+    if (!admit())
+        return false;
+    const auto result = dbus_connection_send(connection, message, client_serial);
+    if (result && connectionStats != nullptr)
+        connectionStats->sent(message);
+    if (result && flightRecorder != nullptr)
+        flightRecorder->record(message, FLIGHT_OUTGOING);
+    if (result && pcapWriter != nullptr)
+        pcapWriter->capture(message);
+    if (result)
+        trace(TRACE_SEND, message);
+    return result;
 }
 
 udbus_bool_t UDBus::Connection::send_with_reply(UDBus::Message& message, UDBus::PendingCall& pending_return, const int timeout_milliseconds) const noexcept
 {
-    return dbus_connection_send_with_reply(connection, message, pending_return, timeout_milliseconds);
+    if (!admit())
+        return false;
+    const auto start = std::chrono::steady_clock::now();
+    const auto result = dbus_connection_send_with_reply(connection, message, pending_return, timeout_milliseconds);
+    if (result && stats != nullptr)
+        stats->track(message, pending_return, start);
+    if (result && connectionStats != nullptr)
+    {
+        connectionStats->sent(message);
+        connectionStats->track(pending_return);
+    }
+    if (result && flightRecorder != nullptr)
+    {
+        flightRecorder->record(message, FLIGHT_OUTGOING);
+        flightRecorder->track(pending_return);
+    }
+    if (result && pcapWriter != nullptr)
+    {
+        pcapWriter->capture(message);
+        pcapWriter->track(pending_return);
+    }
+    if (result)
+        trace(TRACE_SEND, message);
+    return result;
 }
 
 UDBus::Message UDBus::Connection::send_with_reply_and_block(UDBus::Message& message, const int timeout_milliseconds, UDBus::Error& error) const noexcept
 {
-    return Message(dbus_connection_send_with_reply_and_block(connection, message, timeout_milliseconds, error));
+    if (!admit())
+    {
+        error.set(DBUS_ERROR_LIMITS_EXCEEDED, "The outgoing queue of the connection is full");
+        return Message{};
+    }
+    if (stats == nullptr && connectionStats == nullptr && flightRecorder == nullptr && pcapWriter == nullptr && traceTarget.load(std::memory_order_relaxed) == nullptr)
+        return Message(dbus_connection_send_with_reply_and_block(connection, message, timeout_milliseconds, error));
+
+    if (connectionStats != nullptr)
+        connectionStats->begin_blocking_call();
+    const auto start = std::chrono::steady_clock::now();
+    Message reply(dbus_connection_send_with_reply_and_block(connection, message, timeout_milliseconds, error));
+    if (stats != nullptr)
+        stats->record(METHOD_STATS_CLIENT, message, reply, std::chrono::steady_clock::now() - start);
+    if (connectionStats != nullptr)
+    {
+        connectionStats->end_blocking_call();
+        // Calls that failed before they were queued never got a serial and were not sent
+        if (dbus_message_get_serial(message) != 0)
+            connectionStats->sent(message);
+        connectionStats->received(reply);
+    }
+    if (flightRecorder != nullptr)
+    {
+        // The serial is only assigned by the send, so a call that could not be queued is recorded with serial 0
+        flightRecorder->record(message, FLIGHT_OUTGOING);
+        if (reply.is_valid())
+            flightRecorder->record(reply, FLIGHT_INCOMING);
+    }
+    if (pcapWriter != nullptr)
+    {
+        // Unlike the flight recorder, the capture should only hold what went over the wire
+        if (dbus_message_get_serial(message) != 0)
+            pcapWriter->capture(message);
+        if (reply.is_valid())
+            pcapWriter->capture(reply);
+    }
+    // The send is reported with the time it started at, as the serial is only known once the call returns
+    if (dbus_message_get_serial(message) != 0)
+        trace(TRACE_SEND, message, start);
+    if (reply.is_valid())
+        trace(TRACE_RECEIVE, reply);
+    return reply;
+}
+
+udbus_bool_t UDBus::Connection::send_with_reply_batch(std::vector<Message>& messages, std::vector<BatchReply>& replies, const int timeout_milliseconds, size_t window) const noexcept
+{
+    replies.clear();
+    replies.resize(messages.size());
+    std::vector<PendingCall> pending(messages.size());
+
+    if (window == 0)
+        window = messages.size();
+
+    bool bAllSucceeded = true;
+    size_t sent = 0;
+    for (size_t collected = 0; collected < messages.size(); collected++)
+    {
+        // Top up the window and push everything out with a single flush, instead of a flush per message
+        if (sent < messages.size() && sent - collected < window)
+        {
+            for (; sent < messages.size() && sent - collected < window; sent++)
+                if (!send_with_reply(messages[sent], pending[sent], timeout_milliseconds))
+                {
+                    if (backpressure != nullptr && backpressure->bCongested)
+                        replies[sent].error.set(DBUS_ERROR_LIMITS_EXCEEDED, "The outgoing queue of the connection is full");
+                    else
+                        replies[sent].error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to send the method call");
+                }
+            flush();
+        }
+
+        auto& call = pending[collected];
+        auto& result = replies[collected];
+
+        // A null pending call without an error means that the connection was disconnected
+        if (static_cast<DBusPendingCall*>(call) == nullptr)
+        {
+            if (!result.error.is_set())
+                result.error.set(DBUS_ERROR_DISCONNECTED, "The connection is closed");
+            bAllSucceeded = false;
+            continue;
+        }
+
+        // Replies for later calls that arrive while blocking are queued in their own pending calls
+        call.block();
+        result.reply.pending_call_steal_reply(call);
+        call.unref();
+
+        if (!result.reply.is_valid())
+        {
+            result.error.set(DBUS_ERROR_NO_REPLY, "The pending call completed without a reply");
+            bAllSucceeded = false;
+        }
+        else if (result.reply.get_type() == DBUS_MESSAGE_TYPE_ERROR)
+        {
+            dbus_set_error_from_message(result.error, result.reply);
+            bAllSucceeded = false;
+        }
+    }
+    return bAllSucceeded;
 }
 
 int UDBus::Connection::request_name(const char* name, const unsigned int flags, UDBus::Error& error) const noexcept
@@ -119,16 +275,246 @@ int UDBus::Connection::request_name(const char* name, const unsigned int flags,
 
 udbus_bool_t UDBus::Connection::read_write(const int timeout_milliseconds) const noexcept
 {
+    if (busyPollState != nullptr && timeout_milliseconds != 0)
+        return busyPoll(timeout_milliseconds, false);
     return dbus_connection_read_write(connection, timeout_milliseconds);
 }
 
 udbus_bool_t UDBus::Connection::read_write_dispatch(const int timeout_milliseconds) const noexcept
 {
+    if (busyPollState != nullptr && timeout_milliseconds != 0)
+        return busyPoll(timeout_milliseconds, true);
     return dbus_connection_read_write_dispatch(connection, timeout_milliseconds);
 }
 
 UDBus::Message UDBus::Connection::pop_message() const noexcept
 {
-    return Message(dbus_connection_pop_message(connection));
+    Message message(dbus_connection_pop_message(connection));
+    if (connectionStats != nullptr)
+        connectionStats->received(message);
+    if (flightRecorder != nullptr && message.is_valid())
+        flightRecorder->record(message, FLIGHT_INCOMING);
+    if (pcapWriter != nullptr && message.is_valid())
+        pcapWriter->capture(message);
+    if (message.is_valid())
+        trace(TRACE_RECEIVE, message);
+    return message;
 }
 
+
+void UDBus::Connection::set_backpressure(const Backpressure& backpressure) noexcept
+{
+    this->backpressure = std::make_unique<BackpressureState>();
+    this->backpressure->config = backpressure;
+
+    auto& config = this->backpressure->config;
+    if (config.lowBytes > config.highBytes)
+        config.lowBytes = config.highBytes;
+    if (config.lowUnixFds > config.highUnixFds)
+        config.lowUnixFds = config.highUnixFds;
+}
+
+void UDBus::Connection::clear_backpressure() noexcept
+{
+    backpressure.reset();
+}
+
+bool UDBus::Connection::is_congested() const noexcept
+{
+    if (backpressure == nullptr)
+        return false;
+
+    const auto& state = *backpressure;
+    const auto& config = state.config;
+    const long bytes = get_outgoing_size();
+    const long fds = get_outgoing_unix_fds();
+
+    // The gap between the watermarks gives hysteresis, so that the handler is not called on every single send when
+    // the queue hovers around one value
+    if (!state.bCongested)
+        return (config.highBytes > 0 && bytes >= config.highBytes) || (config.highUnixFds > 0 && fds >= config.highUnixFds);
+    return !((config.highBytes == 0 || bytes <= config.lowBytes) && (config.highUnixFds == 0 || fds <= config.lowUnixFds));
+}
+
+bool UDBus::Connection::poll_backpressure() noexcept
+{
+    return updateBackpressure();
+}
+
+bool UDBus::Connection::updateBackpressure() const noexcept
+{
+    if (backpressure == nullptr)
+        return false;
+
+    auto& state = *backpressure;
+    const bool bCongested = is_congested();
+    if (bCongested != state.bCongested)
+    {
+        state.bCongested = bCongested;
+        if (state.config.handler)
+            state.config.handler(bCongested);
+    }
+    return bCongested;
+}
+
+bool UDBus::Connection::admit() const noexcept
+{
+    if (backpressure == nullptr || !updateBackpressure())
+        return true;
+
+    switch (backpressure->config.policy)
+    {
+    case BACKPRESSURE_CALLBACK:
+        return true;
+    case BACKPRESSURE_FAIL_FAST:
+        return false;
+    case BACKPRESSURE_BLOCK:
+        break;
+    }
+
+    const int timeout = backpressure->config.blockTimeoutMilliseconds;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (updateBackpressure())
+    {
+        int remaining = -1;
+        if (timeout >= 0)
+        {
+            remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count());
+            if (remaining <= 0)
+                return false;
+        }
+
+        // Blocks until the socket can take more data, then writes out as much of the queue as it can. Incoming
+        // messages read in the meantime stay queued for pop_message/dispatch as usual
+        if (!dbus_connection_read_write(connection, remaining))
+            return false;
+    }
+    return true;
+}
+
+long UDBus::Connection::get_outgoing_size() const noexcept
+{
+    return dbus_connection_get_outgoing_size(connection);
+}
+
+long UDBus::Connection::get_outgoing_unix_fds() const noexcept
+{
+    return dbus_connection_get_outgoing_unix_fds(connection);
+}
+
+void UDBus::Connection::set_busy_poll(const BusyPoll& busyPoll) noexcept
+{
+    busyPollState = std::make_unique<BusyPollState>();
+    busyPollState->config = busyPoll;
+}
+
+void UDBus::Connection::clear_busy_poll() noexcept
+{
+    busyPollState.reset();
+}
+
+UDBus::BusyPollStats UDBus::Connection::get_busy_poll_stats() const noexcept
+{
+    if (busyPollState == nullptr)
+        return {};
+    return {
+        .spinNanoseconds = busyPollState->spinNanoseconds.load(std::memory_order_relaxed),
+        .sleepNanoseconds = busyPollState->sleepNanoseconds.load(std::memory_order_relaxed),
+        .spinWakeups = busyPollState->spinWakeups.load(std::memory_order_relaxed),
+        .sleepWakeups = busyPollState->sleepWakeups.load(std::memory_order_relaxed),
+    };
+}
+
+udbus_bool_t UDBus::Connection::busyPoll(const int timeout_milliseconds, const bool bDispatch) const noexcept
+{
+    using Clock = std::chrono::steady_clock;
+    auto& state = *busyPollState;
+
+    if (state.config.cpu >= 0 && state.pinnedThread != std::this_thread::get_id())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(state.config.cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        state.pinnedThread = std::this_thread::get_id();
+    }
+
+    const auto start = Clock::now();
+    const auto spinEnd = start + state.config.budget;
+    auto now = start;
+    while (true)
+    {
+        // Messages that are already queued do not need a read at all. This is also checked once after the budget runs
+        // out, as the last non-blocking read may have queued a message that blocking would otherwise sit on
+        if (dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)
+        {
+            state.spinNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count(), std::memory_order_relaxed);
+            state.spinWakeups.fetch_add(1, std::memory_order_relaxed);
+            return bDispatch ? dbus_connection_read_write_dispatch(connection, 0) : true;
+        }
+        if (now >= spinEnd)
+            break;
+        if (!dbus_connection_read_write(connection, 0))
+            return false;
+        now = Clock::now();
+    }
+    state.spinNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count(), std::memory_order_relaxed);
+
+    // The spin counts against the timeout of the call
+    int remaining = timeout_milliseconds;
+    if (timeout_milliseconds > 0)
+    {
+        remaining -= static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count());
+        if (remaining < 0)
+            remaining = 0;
+    }
+
+    // Reads without dispatching first, as dispatching would consume the message that tells whether the read found data
+    const auto result = dbus_connection_read_write(connection, remaining);
+    state.sleepNanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - now).count(), std::memory_order_relaxed);
+    if (dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)
+        state.sleepWakeups.fetch_add(1, std::memory_order_relaxed);
+    // Dispatches what was read without blocking again. On a closed connection this still dispatches the messages
+    // that are left, including Disconnected, and then returns false
+    return bDispatch ? dbus_connection_read_write_dispatch(connection, 0) : result;
+}
+
+void UDBus::Connection::set_stats(MethodStats* stats) noexcept
+{
+    this->stats = stats;
+}
+
+UDBus::MethodStats* UDBus::Connection::get_stats() const noexcept
+{
+    return stats;
+}
+
+void UDBus::Connection::set_connection_stats(ConnectionStats* stats) noexcept
+{
+    connectionStats = stats;
+}
+
+UDBus::ConnectionStats* UDBus::Connection::get_connection_stats() const noexcept
+{
+    return connectionStats;
+}
+
+void UDBus::Connection::set_flight_recorder(FlightRecorder* recorder) noexcept
+{
+    flightRecorder = recorder;
+}
+
+UDBus::FlightRecorder* UDBus::Connection::get_flight_recorder() const noexcept
+{
+    return flightRecorder;
+}
+
+void UDBus::Connection::set_pcap_writer(PcapWriter* writer) noexcept
+{
+    pcapWriter = writer;
+}
+
+UDBus::PcapWriter* UDBus::Connection::get_pcap_writer() const noexcept
+{
+    return pcapWriter;
+}
@@ -0,0 +1,81 @@
+#include "DBusUtilsConcurrency.hpp"
+
+void UDBus::ConnectionPool::bus_get_private(const DBusBusType type, Error& error, const size_t shards) noexcept
+{
+    openShards(shards, error, [&](Connection& connection) -> void
+    {
+        connection.bus_get_private(type, error);
+        // A pool is not the whole application, so losing one of its connections must not exit the process
+        if (connection != nullptr)
+            dbus_connection_set_exit_on_disconnect(connection, false);
+    });
+}
+
+void UDBus::ConnectionPool::open_private(const char* address, Error& error, const size_t shards) noexcept
+{
+    openShards(shards, error, [&](Connection& connection) -> void
+    {
+        connection.open_private(address, error);
+    });
+}
+
+size_t UDBus::ConnectionPool::shard(const Message& message, const ShardPolicy policy) const noexcept
+{
+    if (policy == SHARD_BY_DESTINATION)
+    {
+        const char* destination = dbus_message_get_destination(message);
+        return std::hash<std::string_view>{}(destination == nullptr ? "" : destination) % connections.size();
+    }
+
+    // Threads get sequential ids instead of hashing their std::thread::id, so they are spread evenly over the shards
+    static std::atomic<size_t> threadCount = 0;
+    thread_local const size_t threadID = threadCount++;
+    return threadID % connections.size();
+}
+
+const UDBus::Connection& UDBus::ConnectionPool::get(const size_t shard) const noexcept
+{
+    return connections[shard]->connection;
+}
+
+udbus_bool_t UDBus::ConnectionPool::send(Message& message, dbus_uint32_t* client_serial, const ShardPolicy policy) noexcept
+{
+    if (connections.empty())
+        return false;
+    return connections[shard(message, policy)]->connection.send(message, client_serial);
+}
+
+UDBus::Message UDBus::ConnectionPool::send_with_reply_and_block(Message& message, const int timeout_milliseconds, Error& error, const ShardPolicy policy) noexcept
+{
+    if (connections.empty())
+    {
+        error.set(DBUS_ERROR_DISCONNECTED, "The connection pool is not open");
+        return Message{};
+    }
+
+    auto& a = *connections[shard(message, policy)];
+    a.inFlight.fetch_add(1, std::memory_order_relaxed);
+    auto reply = a.connection.send_with_reply_and_block(message, timeout_milliseconds, error);
+    a.inFlight.fetch_sub(1, std::memory_order_relaxed);
+    return reply;
+}
+
+size_t UDBus::ConnectionPool::size() const noexcept
+{
+    return connections.size();
+}
+
+size_t UDBus::ConnectionPool::queue_depth(const size_t shard) const noexcept
+{
+    return connections[shard]->inFlight.load(std::memory_order_relaxed);
+}
+
+long UDBus::ConnectionPool::outgoing_size(const size_t shard) const noexcept
+{
+    return dbus_connection_get_outgoing_size(connections[shard]->connection);
+}
+
+void UDBus::ConnectionPool::close() noexcept
+{
+    connections.clear();
+}
@@ -0,0 +1,101 @@
+#include "DBusUtilsStats.hpp"
+
+// Marks the pending calls whose connection has statistics, holding a pointer to them
+static dbus_int32_t pendingSlot = -1;
+
+static uint64_t messageSize(const UDBus::Message& message) noexcept
+{
+    char* data = nullptr;
+    int length = 0;
+    if (!message.is_valid() || !message.marshal(&data, &length))
+        return 0;
+    dbus_free(data);
+    return static_cast<uint64_t>(length);
+}
+
+UDBus::ConnectionStats::ConnectionStats(const bool bCountBytes) noexcept
+{
+    this->bCountBytes = bCountBytes;
+    dbus_pending_call_allocate_data_slot(&pendingSlot);
+}
+
+void UDBus::ConnectionStats::sent(const Message& message) noexcept
+{
+    messagesSent.fetch_add(1, std::memory_order_relaxed);
+    if (bCountBytes)
+        bytesSent.fetch_add(messageSize(message), std::memory_order_relaxed);
+}
+
+void UDBus::ConnectionStats::received(const Message& message) noexcept
+{
+    if (!message.is_valid())
+        return;
+
+    messagesReceived.fetch_add(1, std::memory_order_relaxed);
+    if (bCountBytes)
+        bytesReceived.fetch_add(messageSize(message), std::memory_order_relaxed);
+}
+
+void UDBus::ConnectionStats::track(DBusPendingCall* pending) noexcept
+{
+    if (pending == nullptr)
+        return;
+
+    // The call stops being pending once it is freed, whether or not its reply was ever taken
+    pendingCalls.fetch_add(1, std::memory_order_relaxed);
+    if (!dbus_pending_call_set_data(pending, pendingSlot, this, [](void* data) -> void
+    {
+        static_cast<ConnectionStats*>(data)->pendingCalls.fetch_sub(1, std::memory_order_relaxed);
+    }))
+        pendingCalls.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void UDBus::ConnectionStats::complete(DBusPendingCall* pending, const Message& reply) noexcept
+{
+    if (pendingSlot < 0 || pending == nullptr)
+        return;
+
+    auto* stats = static_cast<ConnectionStats*>(dbus_pending_call_get_data(pending, pendingSlot));
+    if (stats != nullptr)
+        stats->received(reply);
+}
+
+void UDBus::ConnectionStats::begin_blocking_call() noexcept
+{
+    pendingCalls.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UDBus::ConnectionStats::end_blocking_call() noexcept
+{
+    pendingCalls.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint64_t UDBus::ConnectionStats::messages_sent() const noexcept
+{
+    return messagesSent.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::ConnectionStats::messages_received() const noexcept
+{
+    return messagesReceived.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::ConnectionStats::bytes_sent() const noexcept
+{
+    return bytesSent.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::ConnectionStats::bytes_received() const noexcept
+{
+    return bytesReceived.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::ConnectionStats::pending_calls() const noexcept
+{
+    return pendingCalls.load(std::memory_order_relaxed);
+}
+
+UDBus::ConnectionStats::~ConnectionStats() noexcept
+{
+    dbus_pending_call_free_data_slot(&pendingSlot);
+}
@@ -1,4 +1,6 @@
 #include "DBusUtils.hpp"
+#include <algorithm>
+#include <mutex>
 
 udbus_bool_t::udbus_bool_t(const dbus_bool_t dbus) noexcept
 {
@@ -9,3 +11,23 @@ udbus_bool_t::operator bool() const noexcept
 {
     return b;
 }
+
+std::atomic<const UDBus::TraceTarget*> UDBus::traceTarget = nullptr;
+
+void UDBus::setTraceHook(const TraceHook hook, void* userData) noexcept
+{
+    if (hook == nullptr)
+    {
+        traceTarget.store(nullptr, std::memory_order_release);
+        return;
+    }
+
+    // Targets are reused when the same hook and user data are installed again, so switching tracing on and off does
+    // not keep allocating
+    static std::mutex mutex;
+    static std::vector<std::unique_ptr<TraceTarget>> targets;
+    std::lock_guard lock(mutex);
+    const auto it = std::ranges::find_if(targets, [&](const auto& a) -> bool { return a->hook == hook && a->userData == userData; });
+    const TraceTarget* target = it != targets.end() ? it->get() : targets.emplace_back(std::make_unique<TraceTarget>(hook, userData)).get();
+    traceTarget.store(target, std::memory_order_release);
+}
@@ -17,6 +17,11 @@
 #pragma once
 #include "DBusUtilsMeta.hpp"
 #include <stack>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <thread>
 
 #define UDBUS_GET_MESSAGE(x) *(x).getMessagePointer()
 
@@ -58,6 +63,116 @@ namespace UDBus
         DBusError error = {};
     };
 
+    // Work done by the encoding and decoding paths, see MessageBuilder::get_stats and Message::get_decode_stats. Only
+    // counted when the library is built with UDBUS_CODEC_COUNTERS, otherwise everything stays at 0.
+    //
+    // Counting allocations makes such a build replace the global operator new and operator delete for the whole
+    // process. An application that replaces them itself fails to link against it, so only enable UDBUS_CODEC_COUNTERS
+    // in builds made for profiling.
+    struct CodecStats
+    {
+        // Heap allocations made through operator new, which covers the library and the standard containers but not
+        // libdbus itself
+        uint64_t allocations = 0;
+        // Bytes of strings copied into MessageBuilder::tempStrings, of appended arrays and of fixed size values read out
+        // of messages
+        uint64_t bytesCopied = 0;
+        // Calls into the libdbus iterator API
+        uint64_t iteratorOperations = 0;
+    };
+
+#ifdef UDBUS_CODEC_COUNTERS
+    // The running totals of the current thread, the per call stats are differences of these
+    extern thread_local CodecStats codecCounters;
+
+    #define UDBUS_COUNT_COPY(x) UDBus::codecCounters.bytesCopied += (x)
+    #define UDBUS_COUNT_ITERATOR_OPERATION() UDBus::codecCounters.iteratorOperations++
+#else
+    #define UDBUS_COUNT_COPY(x) ((void)0)
+    #define UDBUS_COUNT_ITERATOR_OPERATION() ((void)0)
+#endif
+
+    // Adds the work done on the current thread during its lifetime to a stats struct. Does nothing for nullptr
+    class CodecScope
+    {
+    public:
+        explicit CodecScope([[maybe_unused]] CodecStats* target) noexcept
+        {
+#ifdef UDBUS_CODEC_COUNTERS
+            this->target = target;
+            start = codecCounters;
+#endif
+        }
+
+        CodecScope(const CodecScope&) = delete;
+        CodecScope& operator=(const CodecScope&) = delete;
+
+        ~CodecScope() noexcept
+        {
+#ifdef UDBUS_CODEC_COUNTERS
+            if (target == nullptr)
+                return;
+            target->allocations += codecCounters.allocations - start.allocations;
+            target->bytesCopied += codecCounters.bytesCopied - start.bytesCopied;
+            target->iteratorOperations += codecCounters.iteratorOperations - start.iteratorOperations;
+#endif
+        }
+    private:
+#ifdef UDBUS_CODEC_COUNTERS
+        CodecStats* target = nullptr;
+        CodecStats start{};
+#endif
+    };
+
+    // The points in the lifetime of a message that are reported to the trace hook
+    enum TraceEvent
+    {
+        // MessageBuilder::setMessage and EndMessage. The message has no serial yet, so the hook gets a serial of 0 and
+        // can only match these to the send by the message pointer
+        TRACE_BUILD_BEGIN,
+        TRACE_BUILD_END,
+        // Connection::send, send_with_reply and send_with_reply_and_block, once the message has its serial
+        TRACE_SEND,
+        // Connection::pop_message, replies of send_with_reply_and_block and Message::pending_call_steal_reply
+        TRACE_RECEIVE,
+        // The top-level Message::handleMessage call
+        TRACE_DECODE_BEGIN,
+        TRACE_DECODE_END,
+        // After SignalRouter::dispatch called the handlers of a signal and after ReplyTable::route ran a continuation
+        TRACE_HANDLER_END,
+    };
+
+    using TraceHook = void(*)(TraceEvent event, DBusMessage* message, dbus_uint32_t serial, std::chrono::steady_clock::time_point timestamp, void* userData);
+
+    // Installs a process-wide hook that is called at every TraceEvent, to feed a tracing backend with per-message time
+    // breakdowns. The hook runs on the thread that reached the event and must be cheap. Without a hook every trace
+    // point costs a single atomic load. nullptr removes the hook. May be called while other threads are tracing, they
+    // see either the old hook with its user data or the new one with its user data
+    void setTraceHook(TraceHook hook, void* userData) noexcept;
+
+    // A hook together with its user data, so that both are published with a single atomic store. Installed targets are
+    // never freed, as a tracing thread may still be using one after it was replaced
+    struct TraceTarget
+    {
+        TraceHook hook = nullptr;
+        void* userData = nullptr;
+    };
+
+    extern std::atomic<const TraceTarget*> traceTarget;
+
+    inline void trace(const TraceEvent event, DBusMessage* message, const std::chrono::steady_clock::time_point timestamp) noexcept
+    {
+        const auto* target = traceTarget.load(std::memory_order_acquire);
+        if (target != nullptr) [[unlikely]]
+            target->hook(event, message, message == nullptr ? 0 : dbus_message_get_serial(message), timestamp, target->userData);
+    }
+
+    inline void trace(const TraceEvent event, DBusMessage* message) noexcept
+    {
+        if (traceTarget.load(std::memory_order_relaxed) != nullptr) [[unlikely]]
+            trace(event, message, std::chrono::steady_clock::now());
+    }
+
     class Message;
 
     // An abstraction on top of the regular low level iterator constructs. May be easier for some users to use, if they
@@ -118,6 +233,14 @@ namespace UDBus
         int get_element_count() noexcept;
         void get_fixed_array(void* value, int* n_elements) noexcept;
 
+        /**
+         * @brief Appends a deep copy of the value a read iterator points to, to an append iterator
+         * @param src - The read iterator. It is not advanced
+         * @param dest - The append iterator
+         * @return false on OOM
+         */
+        static bool copy(DBusMessageIter* src, DBusMessageIter* dest) noexcept;
+
         ~Iterator();
     private:
         enum IteratorType
@@ -167,6 +290,7 @@ namespace UDBus
         template<typename T>
         MessageBuilder& append(const T& t) noexcept
         {
+            CodecScope scope(&stats);
             if (nodeStack.empty())
                 nodeStack.push(&node);
 
@@ -180,6 +304,7 @@ namespace UDBus
             if constexpr (Tag<T>::TypeString == DBUS_TYPE_STRING)
             {
                 tempStrings.push_back(t);
+                UDBUS_COUNT_COPY(tempStrings.back().size() + 1);
                 appendGenericBasic(DBUS_TYPE_STRING, (void*)(tempStrings.size() - 1));
             }
             else
@@ -190,6 +315,7 @@ namespace UDBus
         template<typename T>
         MessageBuilder& append(const std::vector<T>& t) noexcept
         {
+            CodecScope scope(&stats);
             if (nodeStack.empty())
                 nodeStack.push(&node);
 
@@ -204,11 +330,20 @@ namespace UDBus
             }
             else
                 appendArrayBasic(Tag<T>::TypeString, (void*)t.data(), t.size(), sizeof(T));
+            UDBUS_COUNT_COPY(t.size() * sizeof(T));
             return *this;
         }
 
+        // The work done by this builder since it was created or given a new message
+        [[nodiscard]] const CodecStats& get_stats() const noexcept;
+
+        // Whether an array could not be given a signature, because it was empty or its elements had different types.
+        // The containers of such a message are not written on EndMessage, so the message should not be sent
+        [[nodiscard]] bool failed() const noexcept;
+
     private:
         Message* message = nullptr;
+        CodecStats stats{};
 
         void appendGenericBasic(char type, void* data) const noexcept;
         void appendArrayBasic(char type, void* data, size_t n, size_t size) const noexcept;
@@ -235,6 +370,7 @@ namespace UDBus
         AppendNode node{};
         std::stack<AppendNode*> nodeStack;
         size_t layerDepth = 0;
+        bool bFailed = false;
     };
     template<> MessageBuilder& MessageBuilder::append<MessageManipulators>(const MessageManipulators& op) noexcept;
 
@@ -256,6 +392,11 @@ namespace UDBus
         RESULT_INVALID_VARIANT_PARSING,
     };
 
+    // Process-wide counters of failed Message::handleMessage calls, indexed by their result. Only top-level calls are
+    // counted, so that a failure in a nested container is not counted once per level
+    void countDecodeError(MessageGetResult result) noexcept;
+    [[nodiscard]] uint64_t getDecodeErrors(MessageGetResult result) noexcept;
+
     // An abstraction on top of DBusMessage* to support RAII and make calls more concise. All functions that return a
     // DBusMessage* are also replicated here as member functions without the "dbus_message" prefix.
     //
@@ -315,6 +456,8 @@ namespace UDBus
         void unref() noexcept;
 
         void demarshal(const char* str, int len, DBusError* error) noexcept;
+        // The returned data has to be freed with dbus_free
+        udbus_bool_t marshal(char** marshalled_data_p, int* len_p) const noexcept;
 
         void pending_call_steal_reply(DBusPendingCall* pending) noexcept;
 
@@ -340,8 +483,13 @@ namespace UDBus
         template<typename T, typename... T2>
         MessageGetResult handleMessage(Type<T, T2...>& t, UDBus::Iterator* iterator = nullptr) noexcept
         {
+            // Nested calls are part of the work of the top-level call
+            if (iterator == nullptr)
+                decodeStats = {};
+            CodecScope scope(iterator == nullptr ? &decodeStats : nullptr);
             if (iterator == nullptr)
             {
+                trace(TRACE_DECODE_BEGIN, message);
                 iteratorStack.clear();
                 bInitialGet = true;
 
@@ -357,16 +505,23 @@ namespace UDBus
                 iteratorStack.clear();
                 variantStack.clear();
                 bInitialGet = true;
+                if (result != RESULT_SUCCESS)
+                    countDecodeError(result);
+                trace(TRACE_DECODE_END, message);
             }
 
             return result;
         }
 
+        // The work done by the last top-level handleMessage call
+        [[nodiscard]] const CodecStats& get_decode_stats() const noexcept;
+
         ~Message() noexcept;
     private:
         friend class MessageBuilder;
 
         DBusMessage* message = nullptr;
+        CodecStats decodeStats{};
 
         std::deque<Iterator> iteratorStack{};
         // Contains variant structs that will be called for an array of dictionary of variants.
@@ -491,7 +646,12 @@ else
         {
             // Make an exception for object paths as strings
             if (type == Tag<T>::TypeString || (type == DBUS_TYPE_OBJECT_PATH && Tag<T>::TypeString == DBUS_TYPE_STRING))
+            {
                 it.get_basic((void*)data);
+                // Strings are not copied, only a pointer into the message is read
+                if constexpr (Tag<T>::TypeString != DBUS_TYPE_STRING)
+                    UDBUS_COUNT_COPY(sizeof(T));
+            }
             else
                 return RESULT_INVALID_BASIC_TYPE;
             return RESULT_SUCCESS;
@@ -579,6 +739,68 @@ else
     };
 
     class PendingCall;
+    class MethodStats;
+    class ConnectionStats;
+    class FlightRecorder;
+    class PcapWriter;
+
+    // The result of a single call in a batch, see Connection::send_with_reply_batch. The error is set when the call
+    // could not be sent, timed out or the peer replied with an error message.
+    struct BatchReply
+    {
+        Message reply{};
+        Error error{};
+    };
+
+    // What the send functions of a connection do while its outgoing queue is above the high watermark
+    enum BackpressurePolicy
+    {
+        // Write out the queue until it drains below the low watermark or the timeout expires, then send
+        BACKPRESSURE_BLOCK,
+        // Refuse to queue the message
+        BACKPRESSURE_FAIL_FAST,
+        // Queue the message anyway and only notify the handler when a watermark is crossed
+        BACKPRESSURE_CALLBACK,
+    };
+
+    // Called with true when the outgoing queue crosses a high watermark and with false when it falls back under the low
+    // watermarks
+    using BackpressureHandler = std::function<void(bool bCongested)>;
+
+    // Watermarks for the outgoing queue of a connection, see Connection::set_backpressure. libdbus only reports the
+    // size of the queue in bytes and in unix fds, so those are what the watermarks are measured in. A high watermark of
+    // 0 disables that dimension.
+    struct Backpressure
+    {
+        long highBytes = 0;
+        long lowBytes = 0;
+        long highUnixFds = 0;
+        long lowUnixFds = 0;
+
+        BackpressurePolicy policy = BACKPRESSURE_BLOCK;
+        // Only used by BACKPRESSURE_BLOCK. -1 waits forever
+        int blockTimeoutMilliseconds = -1;
+        BackpressureHandler handler{};
+    };
+
+    // An opt-in low-latency mode for read_write and read_write_dispatch, see Connection::set_busy_poll
+    struct BusyPoll
+    {
+        // How long to spin on non-blocking reads before falling back to blocking in poll
+        std::chrono::microseconds budget{50};
+        // The CPU core to pin the polling thread to, or -1 to leave the affinity alone
+        int cpu = -1;
+    };
+
+    // Where the time of busy-polling reads went. Useful for trading CPU time for tail latency per connection
+    struct BusyPollStats
+    {
+        uint64_t spinNanoseconds = 0;
+        uint64_t sleepNanoseconds = 0;
+        // The number of reads that found data while spinning and while blocking respectively
+        uint64_t spinWakeups = 0;
+        uint64_t sleepWakeups = 0;
+    };
 
     class Connection
     {
@@ -620,12 +842,109 @@ else
         udbus_bool_t send_with_reply(Message& message, PendingCall& pending_return, int timeout_milliseconds) const noexcept;
         Message send_with_reply_and_block(Message& message, int timeout_milliseconds, Error& error) const noexcept;
 
+        /**
+         * @brief Sends a batch of method calls back to back with a single flush and gathers their replies in
+         * submission order. This costs about one round trip for the whole batch instead of one round trip per call.
+         * @param messages - The method calls to send
+         * @param replies - Cleared and filled with one reply per message, in the same order as messages
+         * @param timeout_milliseconds - The timeout of every single call
+         * @param window - The maximum number of calls in flight at the same time. 0 sends everything at once
+         * @return true if every call got a non-error reply
+         */
+        udbus_bool_t send_with_reply_batch(std::vector<Message>& messages, std::vector<BatchReply>& replies, int timeout_milliseconds, size_t window = 0) const noexcept;
+
+        /**
+         * @brief Bounds the outgoing queue, so that a peer that stops reading cannot make it grow without limit. Every
+         * send function checks the watermarks before queueing a message and applies the policy while the queue is
+         * congested. Failed sends of send_with_reply_and_block set a DBUS_ERROR_LIMITS_EXCEEDED error. Like the rest of
+         * the connection wrapper, this is not thread-safe
+         * @param backpressure - The watermarks and policy
+         */
+        void set_backpressure(const Backpressure& backpressure) noexcept;
+        void clear_backpressure() noexcept;
+
+        // Whether the outgoing queue is congested right now. Only a query, the handler is not called
+        [[nodiscard]] bool is_congested() const noexcept;
+        // Re-checks the watermarks, calling the handler if one was crossed, and returns whether the queue is congested.
+        // Call this from your event loop to get the low watermark notification without having to send anything
+        bool poll_backpressure() noexcept;
+
+        /**
+         * @brief Makes read_write and read_write_dispatch spin with non-blocking reads for a budget before blocking.
+         * This avoids the wakeup latency of a blocking poll when messages arrive at a high rate, at the cost of CPU
+         * time. Calls with a timeout of 0 are not affected
+         * @param busyPoll - The spin budget and the CPU core that the calling thread of the read functions is pinned to
+         */
+        void set_busy_poll(const BusyPoll& busyPoll) noexcept;
+        void clear_busy_poll() noexcept;
+        [[nodiscard]] BusyPollStats get_busy_poll_stats() const noexcept;
+
+        // Records the latency, bytes and errors of every method call made on this connection, see MethodStats in
+        // DBusUtilsStats.hpp. nullptr disables recording
+        void set_stats(MethodStats* stats) noexcept;
+        [[nodiscard]] MethodStats* get_stats() const noexcept;
+
+        // Counts the messages and bytes sent and received on this connection, as well as its pending calls, see
+        // ConnectionStats in DBusUtilsStats.hpp. Only messages taken with pop_message or as replies are counted as
+        // received. nullptr disables counting
+        void set_connection_stats(ConnectionStats* stats) noexcept;
+        [[nodiscard]] ConnectionStats* get_connection_stats() const noexcept;
+
+        // Records every message sent and received on this connection, see FlightRecorder in DBusUtilsStats.hpp. Only
+        // messages taken with pop_message or as replies are recorded as received. nullptr disables recording
+        void set_flight_recorder(FlightRecorder* recorder) noexcept;
+        [[nodiscard]] FlightRecorder* get_flight_recorder() const noexcept;
+
+        // Captures every message sent and received on this connection to a pcap file, see PcapWriter in
+        // DBusUtilsStats.hpp. Only messages taken with pop_message or as replies are captured as received. nullptr
+        // disables capturing
+        void set_pcap_writer(PcapWriter* writer) noexcept;
+        [[nodiscard]] PcapWriter* get_pcap_writer() const noexcept;
+
+        [[nodiscard]] long get_outgoing_size() const noexcept;
+        [[nodiscard]] long get_outgoing_unix_fds() const noexcept;
+
         ~Connection() noexcept;
     private:
+        friend class Server;
+
+        struct BackpressureState
+        {
+            Backpressure config{};
+            bool bCongested = false;
+        };
+
+        struct BusyPollState
+        {
+            BusyPoll config{};
+            // Pinning is per thread, so remember which thread was pinned last to only pin again when the thread changes
+            std::thread::id pinnedThread{};
+
+            // Atomic, so that the stats can be read from a monitoring thread
+            std::atomic<uint64_t> spinNanoseconds = 0;
+            std::atomic<uint64_t> sleepNanoseconds = 0;
+            std::atomic<uint64_t> spinWakeups = 0;
+            std::atomic<uint64_t> sleepWakeups = 0;
+        };
+
+        // Applies a crossed watermark to the state and calls the handler. Shared by the sends and poll_backpressure
+        bool updateBackpressure() const noexcept;
+        // Returns false if the message should not be queued
+        bool admit() const noexcept;
+        udbus_bool_t busyPoll(int timeout_milliseconds, bool bDispatch) const noexcept;
+
         DBusConnection* connection = nullptr;
         // Private connections (bus_get_private/open_private) must be closed before the final unref, unlike shared
         // connections which must only be unref'd. Tracked here so the destructor releases the connection correctly.
         bool bPrivate = false;
+
+        // Only allocated when backpressure is enabled, so that plain connections stay small
+        std::unique_ptr<BackpressureState> backpressure{};
+        std::unique_ptr<BusyPollState> busyPollState{};
+        MethodStats* stats = nullptr;
+        ConnectionStats* connectionStats = nullptr;
+        FlightRecorder* flightRecorder = nullptr;
+        PcapWriter* pcapWriter = nullptr;
     };
 
     class PendingCall
@@ -662,4 +981,62 @@ else
         DBusPendingCall* pending = nullptr;
 
     };
+
+    // An abstraction on top of DBusServer to support RAII. Servers listen on an address, usually a unix socket, and
+    // accept peer-to-peer connections from clients that call Connection::open_private on that address. This way,
+    // co-located services can talk directly without going through the bus daemon. Accepted connections are regular
+    // private connections, so everything that works on top of Connection works on them too, except for functions that
+    // talk to the bus daemon.
+    //
+    // libdbus servers need a main loop to accept connections, so the server polls its own sockets in accept.
+    class Server
+    {
+    public:
+        Server() = default;
+
+        // The destructor disconnects and unrefs the underlying DBusServer, so copying would double-release it. Only
+        // moves are allowed.
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+        Server(Server&& other) noexcept;
+        Server& operator=(Server&& other) noexcept;
+
+        operator DBusServer*() const noexcept;
+
+        void listen(const char* address, Error& error) noexcept;
+
+        /**
+         * @brief Waits for a client to connect
+         * @param timeout_milliseconds - The maximum time to wait. 0 only accepts already pending clients, -1 waits
+         * forever
+         * @return The new connection, or an invalid connection if no client connected before the timeout
+         */
+        [[nodiscard]] Connection accept(int timeout_milliseconds) noexcept;
+
+        // The returned string has to be freed with dbus_free. Clients connect to this address
+        [[nodiscard]] char* get_address() const noexcept;
+        [[nodiscard]] char* get_id() const noexcept;
+        [[nodiscard]] udbus_bool_t get_is_connected() const noexcept;
+
+        udbus_bool_t set_auth_mechanisms(const char** mechanisms) const noexcept;
+
+        void disconnect() const noexcept;
+        void unref() noexcept;
+
+        ~Server() noexcept;
+    private:
+        // Lives on the heap, as libdbus keeps a pointer to it that has to survive moves of the server
+        struct State
+        {
+            std::vector<DBusWatch*> watches{};
+            std::deque<DBusConnection*> connections{};
+        };
+
+        static dbus_bool_t addWatch(DBusWatch* watch, void* data) noexcept;
+        static void removeWatch(DBusWatch* watch, void* data) noexcept;
+        static void newConnection(DBusServer* server, DBusConnection* connection, void* data) noexcept;
+
+        DBusServer* server = nullptr;
+        std::unique_ptr<State> state{};
+    };
 }
@@ -0,0 +1,409 @@
+// This file contains the asynchronous and caching client layer that sits on top of Connection. None of the classes here
+// are thread-safe unless explicitly stated, just like the rest of the library.
+#pragma once
+#include "DBusUtils.hpp"
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <list>
+#include <string_view>
+#include <unordered_set>
+#include <cstring>
+
+namespace UDBus
+{
+    // Used with std::equal_to<> for hash maps with std::string keys, so that they can be looked up with a const char*
+    // without constructing a std::string
+    struct StringHash
+    {
+        using is_transparent = void;
+        size_t operator()(const std::string_view str) const noexcept
+        {
+            return std::hash<std::string_view>{}(str);
+        }
+    };
+
+    // A hierarchical timing wheel for call deadlines. Inserting and cancelling a timer are O(1) regardless of how many
+    // timers are active, and all timers that expire during an advance are reported in a single batch. The wheel has 4
+    // levels of 64 slots, so at the default 1ms resolution deadlines up to ~4.6 hours are tracked exactly, and longer
+    // ones are re-cascaded until they come into range.
+    class TimingWheel
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        // A handle of 0 is never returned by insert, so it can be used as "no timer"
+        using Handle = uint64_t;
+
+        explicit TimingWheel(std::chrono::milliseconds resolution = std::chrono::milliseconds(1)) noexcept;
+
+        // Schedules a timer that reports value once deadline has passed
+        Handle insert(Clock::time_point deadline, uint64_t value) noexcept;
+
+        // Cancels a timer. Returns false if the timer already expired or was already cancelled
+        bool cancel(Handle handle) noexcept;
+
+        /**
+         * @brief Moves the wheel forward to now
+         * @param now - The current time
+         * @param expired - Called once with the values of all timers that expired, if any did
+         * @return The number of expired timers
+         */
+        size_t advance(Clock::time_point now, const std::function<void(std::vector<uint64_t>&)>& expired) noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+    private:
+        static constexpr size_t LEVEL_BITS = 6;
+        static constexpr size_t LEVEL_SLOTS = 1 << LEVEL_BITS;
+        static constexpr size_t LEVELS = 4;
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        // Timers live in a pool and are linked into their slot through indices, so that they can be unlinked in
+        // constant time without any allocations
+        struct Node
+        {
+            uint64_t expiry = 0;
+            uint64_t value = 0;
+            uint32_t prev = NONE;
+            uint32_t next = NONE;
+            uint32_t slot = NONE;
+            uint32_t generation = 1;
+        };
+
+        void link(uint32_t index) noexcept;
+        void unlink(uint32_t index) noexcept;
+        void release(uint32_t index) noexcept;
+        void cascade(size_t level) noexcept;
+
+        [[nodiscard]] uint64_t toTicks(Clock::time_point time) const noexcept;
+
+        Clock::time_point epoch{};
+        Clock::duration resolution{};
+        uint64_t currentTick = 0;
+
+        std::vector<Node> nodes{};
+        std::vector<uint32_t> freeNodes{};
+        uint32_t heads[LEVELS * LEVEL_SLOTS]{};
+        size_t count = 0;
+    };
+
+    // Called with the reply to a tracked call. If the call failed, including when it timed out, the error is set. On
+    // timeouts the reply is an invalid message.
+    using ReplyContinuation = std::function<void(Message& reply, Error& error)>;
+
+    // Correlates replies to calls sent through Connection::send by their serial, so that replies can be drained with
+    // pop_message without allocating a DBusPendingCall (and taking its locks) for every call. Calls are stored in an
+    // open addressing hash table keyed on the serial. If the connection has MethodStats attached, the round trip of
+    // every call is recorded when it is routed or expires, like for send_with_reply.
+    //
+    // A typical loop looks like this:
+    // while (connection.read_write(10))
+    // {
+    //     table.expire();
+    //     for (auto msg = table.pop_message(connection); msg.is_valid(); msg = table.pop_message(connection))
+    //         handleMessage(msg);
+    // }
+    class ReplyTable
+    {
+    public:
+        explicit ReplyTable(size_t capacity = 64) noexcept;
+
+        // Slots own their continuations, which may capture anything, so copying is forbidden
+        ReplyTable(const ReplyTable&) = delete;
+        ReplyTable& operator=(const ReplyTable&) = delete;
+        ReplyTable(ReplyTable&&) noexcept = default;
+        ReplyTable& operator=(ReplyTable&&) noexcept = default;
+
+        /**
+         * @brief Sends a method call and tracks its reply
+         * @param connection - The connection to send the message on
+         * @param message - The method call
+         * @param continuation - Called once, with either the reply or an error
+         * @param timeout_milliseconds - Same semantics as the libdbus timeouts, including DBUS_TIMEOUT_USE_DEFAULT and
+         * DBUS_TIMEOUT_INFINITE
+         * @return false if the message could not be queued, in which case the continuation is never called
+         */
+        udbus_bool_t send(const Connection& connection, Message& message, ReplyContinuation continuation, int timeout_milliseconds) noexcept;
+
+        // Calls the continuation of a tracked call if the message is its reply. Returns true if the message was consumed
+        bool route(Message& message) noexcept;
+
+        // Pops messages until one that is not a tracked reply is found and returns it. Returns an invalid message
+        // once the incoming queue of the connection is drained
+        [[nodiscard]] Message pop_message(const Connection& connection) noexcept;
+
+        // Fails all calls whose deadline has passed with DBUS_ERROR_NO_REPLY. Returns the number of expired calls.
+        // Deadlines are kept on a TimingWheel, so this is cheap to call on every iteration of the event loop
+        size_t expire() noexcept;
+
+        // Stops tracking a call without calling its continuation
+        bool cancel(dbus_uint32_t serial) noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+    private:
+        using Clock = TimingWheel::Clock;
+
+        struct Slot
+        {
+            // A serial of 0 is never valid on the wire, so it marks an empty slot
+            dbus_uint32_t serial = 0;
+            TimingWheel::Handle timer = 0;
+            ReplyContinuation continuation{};
+
+            // Set when the connection has MethodStats attached, so that the round trip is recorded once the call completes
+            MethodStats* stats = nullptr;
+            Clock::time_point start{};
+            Message call{};
+        };
+
+        [[nodiscard]] size_t find(dbus_uint32_t serial) const noexcept;
+        [[nodiscard]] size_t home(dbus_uint32_t serial) const noexcept;
+
+        void insert(Slot&& slot) noexcept;
+        Slot take(size_t index) noexcept;
+        void grow() noexcept;
+
+        std::vector<Slot> slots{};
+        size_t count = 0;
+
+        TimingWheel wheel{};
+    };
+
+    // Builds a key that identifies a request by its destination, path, interface, member and marshalled body. The
+    // message must not have been sent yet, otherwise its serial becomes part of the key. Returns false on OOM
+    bool makeRequestKey(const Message& message, std::string& key) noexcept;
+
+    // An opt-in client layer that coalesces identical in-flight method calls. Calls are keyed with makeRequestKey, and
+    // while a call is in flight every identical call joins it instead of sending its own message. When the reply
+    // arrives, it is fanned out to all waiters through Message::ref. Only use it for idempotent methods.
+    //
+    // This class is thread-safe, as it is mostly useful when multiple threads make the same calls concurrently.
+    class CallCoalescer
+    {
+    public:
+        explicit CallCoalescer(const Connection& connection) noexcept;
+
+        CallCoalescer(const CallCoalescer&) = delete;
+        CallCoalescer& operator=(const CallCoalescer&) = delete;
+
+        // Blocks until the reply to the message, or to an identical in-flight call, is received
+        Message send_with_reply_and_block(Message& message, int timeout_milliseconds, Error& error) noexcept;
+
+        /**
+         * @brief Sends a method call, or joins an identical in-flight call, without blocking
+         * @param message - The method call
+         * @param continuation - Called with the reply from whichever thread completes the call first. This is either
+         * the thread that dispatches the connection or a thread that waits on the same call in blocking mode
+         * @param timeout_milliseconds - The timeout of the call. Ignored when joining an in-flight call
+         * @return false if the message could not be sent, in which case the continuation is never called
+         */
+        udbus_bool_t send_with_reply(Message& message, ReplyContinuation continuation, int timeout_milliseconds) noexcept;
+
+        // The number of distinct calls that are currently in flight
+        [[nodiscard]] size_t in_flight() noexcept;
+    private:
+        struct Flight
+        {
+            std::string key{};
+            PendingCall pending{};
+            Message reply{};
+            std::vector<ReplyContinuation> continuations{};
+            bool bDone = false;
+        };
+
+        // Owned by the pending call, which is owned by the flight, so the flight is only referenced weakly here.
+        // Otherwise neither would ever be freed
+        struct NotifyData
+        {
+            CallCoalescer* coalescer = nullptr;
+            std::weak_ptr<Flight> flight{};
+        };
+
+        static void notify(DBusPendingCall* pending, void* data) noexcept;
+        static void freeNotifyData(void* data) noexcept;
+
+        // Steals the reply and runs the continuations of a flight. Safe to call from multiple threads, only the first
+        // call does anything
+        void complete(const std::shared_ptr<Flight>& flight) noexcept;
+
+        static void fillError(const Message& reply, Error& error) noexcept;
+
+        const Connection* connection = nullptr;
+
+        std::mutex mutex{};
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights{};
+    };
+
+    // An opt-in client-side cache of replies to idempotent calls. Only methods that were given a TTL are cached,
+    // entries are keyed with makeRequestKey and the least recently used entries are evicted once the memory bound is
+    // reached. Cache hits return a new reference to the cached reply instead of making a round trip.
+    class ReplyCache
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // The memory bound covers the marshalled size of both the requests and the replies
+        explicit ReplyCache(size_t maxBytes = 1024 * 1024) noexcept;
+
+        ReplyCache(const ReplyCache&) = delete;
+        ReplyCache& operator=(const ReplyCache&) = delete;
+
+        // Enables caching of a method. Replies are served from the cache for ttl after they were received
+        void set_ttl(const char* interface, const char* member, std::chrono::milliseconds ttl) noexcept;
+
+        // When a signal_interface.signal_member signal is passed to handleSignal, all cached calls to
+        // interface.member on the object path that emitted the signal are invalidated. Returns false if the signal
+        // interface or member is nullptr
+        bool invalidate_on(const char* signal_interface, const char* signal_member, const char* interface, const char* member) noexcept;
+
+        // Same as Connection::send_with_reply_and_block, except that cached replies are returned without a round trip
+        Message send_with_reply_and_block(const Connection& connection, Message& message, int timeout_milliseconds, Error& error) noexcept;
+
+        // Applies the invalidation rules to a received signal. Returns true if any entry was invalidated
+        bool handleSignal(const Message& signal) noexcept;
+
+        void invalidate(const char* interface, const char* member) noexcept;
+        void clear() noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+        [[nodiscard]] size_t bytes() const noexcept;
+    private:
+        struct Entry
+        {
+            std::string key{};
+            std::string method{};
+            std::string path{};
+            Message reply{};
+            Clock::time_point expiry{};
+            size_t bytes = 0;
+        };
+
+        struct InvalidationRule
+        {
+            std::string signalInterface{};
+            std::string signalMember{};
+            std::string method{};
+        };
+
+        void erase(std::list<Entry>::iterator it) noexcept;
+        static std::string methodName(const char* interface, const char* member) noexcept;
+
+        // Most recently used entries are at the front
+        std::list<Entry> entries{};
+        std::unordered_map<std::string, std::list<Entry>::iterator> lookup{};
+        std::unordered_map<std::string, Clock::duration> ttls{};
+        std::vector<InvalidationRule> rules{};
+
+        size_t maxBytes = 0;
+        size_t currentBytes = 0;
+    };
+
+    // Defined in DBusUtilsSignals.hpp
+    class NameOwnerCache;
+
+    // A client-side cache of the properties of a single interface on a remote object. It is populated once with
+    // GetAll and is kept coherent by passing received PropertiesChanged signals to handleSignal. Reads of cached
+    // properties are served locally in constant time. Invalidated properties are fetched with Get on their next read.
+    // Properties the peer does not have are remembered as missing until the next PropertiesChanged.
+    //
+    // Anyone on the bus can emit a PropertiesChanged signal, so only signals sent by the unique name that owns the
+    // destination are applied. The owner is followed through NameOwnerChanged, which also has to be passed to
+    // handleSignal. When it changes the cache is emptied, and the properties are fetched from the new owner on their
+    // next read.
+    //
+    // The connection must outlive the cache.
+    class PropertiesCache
+    {
+    public:
+        PropertiesCache() = default;
+
+        // Values are stored in messages, so copying is forbidden
+        PropertiesCache(const PropertiesCache&) = delete;
+        PropertiesCache& operator=(const PropertiesCache&) = delete;
+
+        /**
+         * @brief Subscribes to PropertiesChanged for the object and fetches all of its properties with GetAll
+         * @param connection - The connection to the bus
+         * @param destination - The bus name of the peer that owns the object
+         * @param path - The path of the object
+         * @param interface - The interface whose properties are cached
+         * @param error - Set if subscribing or fetching fails
+         * @return true on success
+         */
+        bool populate(const Connection& connection, const char* destination, const char* path, const char* interface, Error& error) noexcept;
+
+        // Applies a PropertiesChanged signal of the owner of the destination, or a NameOwnerChanged signal for the
+        // destination. Returns true if the signal was for the cached object and interface, or for its destination
+        bool handleSignal(const Message& signal) noexcept;
+
+        /**
+         * @brief Reads a property of a basic type. String pointers stay valid until the property changes
+         * @param name - The name of the property
+         * @param value - Set to the value of the property
+         * @return false if the property does not exist or has a different type
+         */
+        template<typename T>
+        bool get(const char* name, T& value) noexcept
+        {
+            const auto* property = find(name);
+            if (property == nullptr)
+                return false;
+
+            // Make an exception for object paths and signatures as strings
+            if (property->type == Tag<T>::TypeString || (Tag<T>::TypeString == DBUS_TYPE_STRING && (property->type == DBUS_TYPE_OBJECT_PATH || property->type == DBUS_TYPE_SIGNATURE)))
+            {
+                std::memcpy(&value, &property->basic, sizeof(T));
+                return true;
+            }
+            return false;
+        }
+
+        // Reads a property of any type using a schema, the same way as Message::handleMessage
+        template<typename T, typename... T2>
+        MessageGetResult get(const char* name, Type<T, T2...>& t) noexcept
+        {
+            auto* property = find(name);
+            if (property == nullptr)
+                return RESULT_NOT_CALLED;
+            return property->value.handleMessage(t);
+        }
+
+        [[nodiscard]] bool contains(const char* name) const noexcept;
+        [[nodiscard]] size_t size() const noexcept;
+
+        // Unsubscribes from PropertiesChanged and drops all properties
+        void clear() noexcept;
+
+        ~PropertiesCache() noexcept;
+    private:
+        struct Property
+        {
+            int type = DBUS_TYPE_INVALID;
+            // A copy of basic values, so that they can be read without parsing the message
+            DBusBasicValue basic{};
+            // A message whose only argument is the value of the property
+            Message value{};
+        };
+
+        Property* find(const char* name) noexcept;
+        bool store(const char* name, DBusMessageIter* value) noexcept;
+        bool storeAll(DBusMessageIter* dict) noexcept;
+        // Follows the destination to a new owner. Called by the NameOwnerCache
+        void onOwnerChanged(const char* newOwner) noexcept;
+
+        const Connection* connection = nullptr;
+        std::unique_ptr<NameOwnerCache> owners{};
+        std::string destination{};
+        // The unique name that owns the destination, which all calls go to and all signals must come from. Empty while
+        // the destination has no owner
+        std::string owner{};
+        // The rule without its sender
+        std::string baseRule{};
+        std::string path{};
+        std::string interface{};
+        std::string rule{};
+
+        std::unordered_map<std::string, Property, StringHash, std::equal_to<>> properties{};
+        // Properties the peer said it does not have. Not asked for again until the next PropertiesChanged
+        std::unordered_set<std::string, StringHash, std::equal_to<>> missing{};
+    };
+}
@@ -0,0 +1,155 @@
+// This file contains the utilities for using the library from multiple threads. Everything here calls
+// dbus_threads_init_default, so that libdbus can be used from multiple threads.
+#pragma once
+#include "DBusUtils.hpp"
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+namespace UDBus
+{
+    enum ShardPolicy
+    {
+        // Every thread always uses the same shard, so threads mostly do not contend with each other
+        SHARD_BY_THREAD,
+        // All calls to the same destination use the same shard, so their order is preserved
+        SHARD_BY_DESTINATION,
+    };
+
+    // A pool of private connections that calls are sharded across. A single DBusConnection serialises all sends behind
+    // its internal lock, so multithreaded clients that send a lot contend on it. Spreading the calls over multiple
+    // connections removes most of that contention.
+    //
+    // Note that every shard is a separate peer on the bus with its own unique name, so replies and signals addressed to
+    // one shard are only received on that shard.
+    class ConnectionPool
+    {
+    public:
+        ConnectionPool() = default;
+
+        ConnectionPool(const ConnectionPool&) = delete;
+        ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+        /**
+         * @brief Opens the shards as private bus connections
+         * @param type - The type of the bus
+         * @param error - Set if any of the connections fails to open, in which case the pool is left empty
+         * @param shards - The number of connections. 0 uses the hardware concurrency of the machine
+         */
+        void bus_get_private(DBusBusType type, Error& error, size_t shards = 0) noexcept;
+        // Same as bus_get_private, but for a peer-to-peer address
+        void open_private(const char* address, Error& error, size_t shards = 0) noexcept;
+
+        // Returns the index of the shard a message is sent on
+        [[nodiscard]] size_t shard(const Message& message, ShardPolicy policy) const noexcept;
+        [[nodiscard]] const Connection& get(size_t shard) const noexcept;
+
+        udbus_bool_t send(Message& message, dbus_uint32_t* client_serial, ShardPolicy policy = SHARD_BY_THREAD) noexcept;
+        Message send_with_reply_and_block(Message& message, int timeout_milliseconds, Error& error, ShardPolicy policy = SHARD_BY_THREAD) noexcept;
+
+        // The number of shards
+        [[nodiscard]] size_t size() const noexcept;
+
+        // The number of blocking calls that are currently waiting for a reply on a shard
+        [[nodiscard]] size_t queue_depth(size_t shard) const noexcept;
+        // The number of bytes in the outgoing queue of a shard
+        [[nodiscard]] long outgoing_size(size_t shard) const noexcept;
+
+        void close() noexcept;
+    private:
+        struct Shard
+        {
+            Connection connection{};
+            std::atomic<size_t> inFlight = 0;
+        };
+
+        template<typename F>
+        void openShards(size_t shards, Error& error, F&& openConnection) noexcept
+        {
+            close();
+            dbus_threads_init_default();
+            if (shards == 0)
+                shards = std::max(std::thread::hardware_concurrency(), 1u);
+
+            for (size_t i = 0; i < shards; i++)
+            {
+                auto& a = connections.emplace_back(std::make_unique<Shard>());
+                openConnection(a->connection);
+                if (error.is_set() || a->connection == nullptr)
+                {
+                    close();
+                    return;
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<Shard>> connections{};
+    };
+
+    // An optional send path for many producer threads. Producers push finished messages into a bounded lock-free
+    // ring, and a single writer thread drains it in batches, sending every message and flushing the connection once per
+    // batch. This gives producers a predictable cost per message and makes fewer syscalls under load.
+    //
+    // The writer sends with Connection::send, so the backpressure policy, the statistics, the flight recorder, the pcap
+    // writer and the trace hook of the connection all see queued messages. A BACKPRESSURE_BLOCK policy blocks the
+    // writer, not the producers, and messages refused by BACKPRESSURE_FAIL_FAST are dropped without counting as sent.
+    //
+    // While the queue is running, the writer thread is the only thread that may send on the connection.
+    class SendQueue
+    {
+    public:
+        // The capacity is rounded up to a power of 2
+        explicit SendQueue(size_t capacity = 4096) noexcept;
+
+        SendQueue(const SendQueue&) = delete;
+        SendQueue& operator=(const SendQueue&) = delete;
+
+        /**
+         * @brief Starts the writer thread
+         * @param connection - The connection to send on. It must outlive the queue, or at least the call to stop
+         * @param batchSize - The maximum number of messages that are sent before each flush
+         */
+        void start(const Connection& connection, size_t batchSize = 64) noexcept;
+
+        // Sends everything that is still queued, then stops the writer thread
+        void stop() noexcept;
+
+        // Moves a message into the queue. Returns false, leaving the message untouched, if the queue is full. Safe to
+        // call from any thread
+        bool push(Message& message) noexcept;
+
+        // The number of messages sent so far and the number of flushes they took
+        [[nodiscard]] size_t sent() const noexcept;
+        [[nodiscard]] size_t batches() const noexcept;
+
+        ~SendQueue() noexcept;
+    private:
+        struct Cell
+        {
+            // Tells producers and the writer whose turn it is to use the cell, see push and pop
+            std::atomic<size_t> sequence = 0;
+            DBusMessage* message = nullptr;
+        };
+
+        DBusMessage* pop() noexcept;
+        void run() noexcept;
+
+        std::unique_ptr<Cell[]> cells{};
+        size_t mask = 0;
+
+        // Kept on separate cache lines, as producers and the writer update them concurrently
+        alignas(64) std::atomic<size_t> enqueuePos = 0;
+        alignas(64) size_t dequeuePos = 0;
+
+        alignas(64) std::atomic<bool> bSleeping = false;
+        std::atomic<uint32_t> wakeups = 0;
+        std::atomic<bool> bStopping = false;
+
+        std::atomic<size_t> sentMessages = 0;
+        std::atomic<size_t> sentBatches = 0;
+
+        const Connection* connection = nullptr;
+        size_t batchSize = 64;
+        std::thread writer{};
+    };
+}
@@ -0,0 +1,292 @@
+// This file contains the signal subscription and incoming message dispatch layer that sits on top of Connection. None
+// of the classes here are thread-safe, just like the rest of the library.
+#pragma once
+#include "DBusUtilsAsync.hpp"
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_set>
+
+namespace UDBus
+{
+    // Describes the signals a subscription is interested in. Fields that are nullptr match anything. path and
+    // path_namespace are mutually exclusive, if both are set only path is used.
+    struct MatchRule
+    {
+        const char* sender = nullptr;
+        const char* path = nullptr;
+        const char* path_namespace = nullptr;
+        const char* interface = nullptr;
+        const char* member = nullptr;
+        // Only matches string, object path and signature first arguments
+        const char* arg0 = nullptr;
+    };
+
+    using SignalHandler = std::function<void(Message&)>;
+
+    // Called when the owner of a tracked name changes. An empty owner means that the name had, or has, no owner
+    using NameOwnerHandler = std::function<void(const char* name, const char* old_owner, const char* new_owner)>;
+
+    // Caches the unique names that own well-known bus names. The cache is kept up to date by passing received
+    // NameOwnerChanged signals to handleSignal, so ownership queries are answered locally, messages can be addressed
+    // to the unique name directly and peer restarts are detected without polling.
+    //
+    // The connection must outlive the cache.
+    class NameOwnerCache
+    {
+    public:
+        explicit NameOwnerCache(const Connection& connection) noexcept;
+
+        NameOwnerCache(const NameOwnerCache&) = delete;
+        NameOwnerCache& operator=(const NameOwnerCache&) = delete;
+
+        // Subscribes to NameOwnerChanged for the name and resolves its current owner with GetNameOwner
+        bool track(const char* name, Error& error) noexcept;
+        void untrack(const char* name) noexcept;
+
+        // Applies a NameOwnerChanged signal. Returns true if it was for a tracked name
+        bool handleSignal(const Message& signal) noexcept;
+
+        // Called from handleSignal whenever the owner of a tracked name changes
+        void set_handler(NameOwnerHandler handler) noexcept;
+
+        // Returns the unique name that owns a tracked name, or nullptr if the name is not tracked or has no owner
+        [[nodiscard]] const char* get_owner(const char* name) const noexcept;
+        [[nodiscard]] bool has_owner(const char* name) const noexcept;
+
+        // Rewrites the destination of an unsent message to the unique name of its owner. Returns false if the owner is
+        // not known. If the owner changes before the message is sent, the message fails instead of reaching the new
+        // owner, which is usually what you want when talking to a stateful peer
+        bool rewrite_destination(Message& message) const noexcept;
+
+        ~NameOwnerCache() noexcept;
+    private:
+        struct Name
+        {
+            std::string owner{};
+            std::string rule{};
+        };
+
+        const Connection* connection = nullptr;
+        NameOwnerHandler handler{};
+        std::unordered_map<std::string, Name, StringHash, std::equal_to<>> names{};
+    };
+
+    // Manages signal subscriptions. Identical bus match rules are deduplicated and reference counted, so that AddMatch
+    // and RemoveMatch are only called once per unique rule. Incoming signals are routed through a trie on
+    // (sender, path/path_namespace, interface, member, arg0), so the cost of dispatch depends on the number of matching
+    // subscriptions rather than on the total number of subscriptions.
+    //
+    // The bus always sends signals with the unique name of the sender, so subscriptions to a well-known sender are
+    // routed through the unique name that currently owns it. The router tracks the owners with a NameOwnerCache, which
+    // follows NameOwnerChanged signals as they are dispatched.
+    //
+    // Also works on peer-to-peer connections, where no match rules are registered as peers send signals directly.
+    //
+    // The connection must outlive the router.
+    class SignalRouter
+    {
+    public:
+        explicit SignalRouter(const Connection& connection) noexcept;
+
+        SignalRouter(const SignalRouter&) = delete;
+        SignalRouter& operator=(const SignalRouter&) = delete;
+
+        /**
+         * @brief Subscribes a handler to the signals described by a rule
+         * @param rule - The signals to subscribe to. The strings are copied
+         * @param handler - Called by dispatch for every matching signal
+         * @param error - Set if adding the bus match rule, or resolving the owner of a well-known sender, fails
+         * @return The id of the subscription, or 0 on failure
+         */
+        size_t subscribe(const MatchRule& rule, SignalHandler handler, Error& error) noexcept;
+
+        // Removes a subscription, and its bus match rule if no other subscription uses it. Handlers may unsubscribe
+        // themselves, or others, while they are called
+        bool unsubscribe(size_t id) noexcept;
+
+        // Calls the handlers of all subscriptions matching the signal. Returns the number of called handlers. Pass
+        // every received signal, NameOwnerChanged signals keep the owners of well-known senders up to date
+        size_t dispatch(Message& message) noexcept;
+
+        // The number of subscriptions
+        [[nodiscard]] size_t size() const noexcept;
+        // The number of unique match rules registered on the bus
+        [[nodiscard]] size_t rules() const noexcept;
+
+        ~SignalRouter() noexcept;
+    private:
+        enum Level
+        {
+            LEVEL_SENDER,
+            LEVEL_PATH,
+            LEVEL_INTERFACE,
+            LEVEL_MEMBER,
+            LEVEL_ARG0,
+            LEVEL_COUNT,
+        };
+
+        struct Node
+        {
+            std::unordered_map<std::string, std::unique_ptr<Node>, StringHash, std::equal_to<>> exact{};
+            // Only used on the path level, for path_namespace rules
+            std::unordered_map<std::string, std::unique_ptr<Node>, StringHash, std::equal_to<>> prefix{};
+            std::unique_ptr<Node> any{};
+
+            // Only used on the leaves
+            std::vector<size_t> subscriptions{};
+        };
+
+        struct Subscription
+        {
+            // Indexed by Level. Empty strings are wildcards
+            std::string fields[LEVEL_COUNT]{};
+            bool bNamespace = false;
+            std::string rule{};
+            SignalHandler handler{};
+            // Set when unsubscribed during dispatch, the subscription is erased once dispatch returns
+            bool bRemoved = false;
+        };
+
+        static std::string buildRule(const MatchRule& rule) noexcept;
+        // Whether the sender has to be resolved to its owner. Unique names and the bus itself are used as they are
+        [[nodiscard]] bool isWellKnown(const std::string& sender) const noexcept;
+        std::unique_ptr<Node>* child(Node& node, const Subscription& subscription, size_t level) noexcept;
+        Node& leaf(const Subscription& subscription) noexcept;
+        // Removes the id from its leaf and erases the nodes left empty. Returns whether the node itself is empty
+        bool prune(Node& node, const Subscription& subscription, size_t id, size_t level) noexcept;
+        void collect(const Node& node, size_t level, const char* const* fields, std::vector<size_t>& result) const noexcept;
+        void releaseSender(const std::string& sender) noexcept;
+        void onOwnerChanged(const char* name, const char* oldOwner, const char* newOwner) noexcept;
+
+        const Connection* connection = nullptr;
+        bool bBus = true;
+
+        Node root{};
+        std::unordered_map<size_t, Subscription> subscriptions{};
+        std::unordered_map<std::string, size_t> ruleReferences{};
+        size_t nextID = 1;
+
+        NameOwnerCache owners;
+        // The number of subscriptions of every well-known sender
+        std::unordered_map<std::string, size_t> senderReferences{};
+        // The well-known senders that every unique name owns
+        std::unordered_map<std::string, std::vector<std::string>, StringHash, std::equal_to<>> ownedNames{};
+
+        size_t dispatchDepth = 0;
+        std::vector<size_t> removed{};
+    };
+
+    // An opt-in stage in front of signal dispatch that coalesces high-frequency signals. Signals of the registered
+    // kinds are held back and keyed on (sender, path, interface, member). Once the window of a key elapses, only its
+    // newest payload is delivered to the sink. PropertiesChanged signals are additionally keyed on their interface and
+    // are merged instead, so that the delivered signal contains the newest value of every property that changed, as
+    // well as every property that was invalidated, during the window.
+    //
+    // Usually used together with a SignalRouter:
+    // SignalCoalescer coalescer(std::chrono::milliseconds(50), [&](Message& m) -> void { router.dispatch(m); });
+    // ...
+    // coalescer.flush();
+    // for (auto msg = connection.pop_message(); msg.is_valid(); msg = connection.pop_message())
+    //     if (!coalescer.push(msg))
+    //         router.dispatch(msg);
+    class SignalCoalescer
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        SignalCoalescer(std::chrono::milliseconds window, SignalHandler sink) noexcept;
+
+        SignalCoalescer(const SignalCoalescer&) = delete;
+        SignalCoalescer& operator=(const SignalCoalescer&) = delete;
+
+        // Enables coalescing for a kind of signal
+        void coalesce(const char* interface, const char* member) noexcept;
+
+        // Holds back a signal if it is of a coalesced kind, moving it into the coalescer. Returns false if the signal
+        // should be dispatched normally, in which case it is left untouched
+        bool push(Message& signal) noexcept;
+
+        // Delivers the coalesced signals whose window has elapsed. Returns the number of delivered signals
+        size_t flush(Clock::time_point now = Clock::now()) noexcept;
+
+        // The number of keys with a pending signal
+        [[nodiscard]] size_t size() const noexcept;
+    private:
+        struct Entry
+        {
+            Clock::time_point deadline{};
+            Message latest{};
+            size_t count = 0;
+
+            // Only used for PropertiesChanged. Values are stored in messages whose only argument is the variant
+            bool bProperties = false;
+            std::map<std::string, Message> changed{};
+            std::set<std::string> invalidated{};
+        };
+
+        static std::string kindName(const char* interface, const char* member) noexcept;
+        static bool mergeProperties(Entry& entry, Message& signal) noexcept;
+        static Message buildProperties(Entry& entry) noexcept;
+
+        Clock::duration window{};
+        SignalHandler sink{};
+
+        std::unordered_set<std::string> kinds{};
+        std::unordered_map<std::string, Entry> entries{};
+        // All keys share the same window, so the order in which windows were opened is also the order of deadlines
+        std::deque<std::string> order{};
+    };
+
+    enum MessageLane
+    {
+        LANE_REPLIES,
+        LANE_METHOD_CALLS,
+        LANE_SIGNALS,
+
+        LANE_COUNT
+    };
+
+    // What to do with an incoming signal when the signal lane is full
+    enum LaneDropPolicy
+    {
+        // Stop draining the connection until there is space again, like the other lanes
+        LANE_DROP_NONE,
+        LANE_DROP_NEWEST,
+        LANE_DROP_OLDEST,
+    };
+
+    // Drains the incoming queue of a connection into bounded priority lanes, so that during a signal storm replies and
+    // method calls do not have to wait behind thousands of signals. pop_message returns replies (including errors)
+    // first, then method calls, then signals.
+    //
+    // The reply and method call lanes never drop messages. When one of them is full, fill stops draining the
+    // connection and the remaining messages stay in the queue of the connection until there is space again.
+    class MessageLanes
+    {
+    public:
+        explicit MessageLanes(size_t replyDepth = 1024, size_t methodCallDepth = 1024, size_t signalDepth = 1024, LaneDropPolicy policy = LANE_DROP_OLDEST) noexcept;
+
+        MessageLanes(const MessageLanes&) = delete;
+        MessageLanes& operator=(const MessageLanes&) = delete;
+
+        // Pops every message that is available on the connection into its lane. Returns the number of popped messages
+        size_t fill(const Connection& connection) noexcept;
+
+        // Returns the message with the highest priority, or an invalid message if all lanes are empty
+        [[nodiscard]] Message pop_message() noexcept;
+
+        [[nodiscard]] size_t size(MessageLane lane) const noexcept;
+        [[nodiscard]] size_t size() const noexcept;
+
+        // The number of signals that were dropped because the signal lane was full
+        [[nodiscard]] size_t dropped() const noexcept;
+    private:
+        static MessageLane classify(const Message& message) noexcept;
+
+        std::deque<Message> lanes[LANE_COUNT]{};
+        size_t depths[LANE_COUNT]{};
+        LaneDropPolicy policy = LANE_DROP_OLDEST;
+        size_t droppedSignals = 0;
+    };
+}
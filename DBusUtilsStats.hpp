@@ -0,0 +1,525 @@
+// This file contains the instrumentation utilities of the library. Everything here is safe to use from multiple threads.
+#pragma once
+#include "DBusUtils.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+// 32 buckets per power of 2 up to 2^40, plus 64 linear buckets for the smallest values
+#define UDBUS_HISTOGRAM_SUB_BUCKET_BITS 6
+#define UDBUS_HISTOGRAM_MAX_BITS 40
+#define UDBUS_HISTOGRAM_BUCKETS ((UDBUS_HISTOGRAM_MAX_BITS - UDBUS_HISTOGRAM_SUB_BUCKET_BITS + 2) << (UDBUS_HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+namespace UDBus
+{
+    // A log-linear histogram in the style of HdrHistogram, usually used for latencies in nanoseconds. Every power of 2
+    // is split into 32 linear buckets, so any recorded value is reported with a relative error of at most ~3%, while
+    // the histogram keeps a fixed size no matter how many values are recorded. Values above 2^40 (about 18 minutes in
+    // nanoseconds) are clamped.
+    //
+    // Recording is lock-free and can be done from any number of threads.
+    class Histogram
+    {
+    public:
+        Histogram() noexcept;
+
+        // The buckets are atomics, so copy with merge instead
+        Histogram(const Histogram&) = delete;
+        Histogram& operator=(const Histogram&) = delete;
+
+        void record(uint64_t value, uint64_t count = 1) noexcept;
+
+        // Adds all values recorded in another histogram to this one
+        void merge(const Histogram& other) noexcept;
+        void reset() noexcept;
+
+        [[nodiscard]] uint64_t count() const noexcept;
+        [[nodiscard]] uint64_t min() const noexcept;
+        [[nodiscard]] uint64_t max() const noexcept;
+        [[nodiscard]] double mean() const noexcept;
+
+        // Returns the value below which the given percentage (0-100) of the recorded values fall
+        [[nodiscard]] uint64_t percentile(double percentage) const noexcept;
+
+        // Calls f(upperBound, count) for every non-empty bucket, in ascending order. Useful for exporting the full
+        // distribution
+        template<typename F>
+        void for_each(F&& f) const noexcept
+        {
+            for (size_t i = 0; i < UDBUS_HISTOGRAM_BUCKETS; i++)
+            {
+                const auto c = buckets[i].load(std::memory_order_relaxed);
+                if (c != 0)
+                    f(upperBound(i), c);
+            }
+        }
+    private:
+        static size_t index(uint64_t value) noexcept;
+        static uint64_t upperBound(size_t index) noexcept;
+
+        std::atomic<uint64_t> buckets[UDBUS_HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> total = 0;
+        std::atomic<uint64_t> sum = 0;
+        std::atomic<uint64_t> minimum = UINT64_MAX;
+        std::atomic<uint64_t> maximum = 0;
+    };
+
+    // Whether the statistics describe calls made by us or calls handled by us
+    enum MethodStatsRole
+    {
+        METHOD_STATS_CLIENT,
+        METHOD_STATS_SERVER,
+    };
+
+    // The merged statistics of one (role, destination, interface, member) key. Latencies are in nanoseconds
+    struct MethodStatsSnapshot
+    {
+        MethodStatsRole role = METHOD_STATS_CLIENT;
+        std::string destination{};
+        std::string interface{};
+        std::string member{};
+
+        uint64_t count = 0;
+        uint64_t errors = 0;
+        // Stay at 0 unless the MethodStats were created with bCountBytes
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+
+        double mean = 0.0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    // Per-method counters and latency histograms. Attach it to a connection with Connection::set_stats to record the
+    // round trip of every call made with send_with_reply_and_block and send_with_reply. Calls made with send_with_reply
+    // are recorded once their reply is taken with Message::pending_call_steal_reply, and calls tracked by a ReplyTable
+    // when their reply is routed or they expire.
+    //
+    // The library has no dispatcher for incoming method calls, SignalRouter only routes signals and ReplyTable only
+    // routes replies to our own calls. So the time spent handling incoming calls can not be recorded by the library,
+    // the handlers of the application have to be wrapped in a MethodStatsScope instead.
+    //
+    // Recording is lock-free. Every thread records into its own shard, which is a fixed-capacity table, so the only
+    // allocation happens the first time a shard sees a method. Calls to methods that do not fit in the table of a shard
+    // are counted in overflowed instead. The statistics must outlive every connection they are attached to.
+    class MethodStats
+    {
+    public:
+        /**
+         * @brief Creates the statistics
+         * @param shards - The number of shards. Threads are spread over them round-robin
+         * @param capacity - The number of different methods every shard can hold
+         * @param bCountBytes - Whether to count the bytes in and out. Messages have no size getter, so this marshals
+         * every call and reply, which costs a full copy of each
+         */
+        explicit MethodStats(size_t shards = 8, size_t capacity = 256, bool bCountBytes = false) noexcept;
+
+        MethodStats(const MethodStats&) = delete;
+        MethodStats& operator=(const MethodStats&) = delete;
+
+        // Records a finished call. reply may be invalid, in which case the call counts as an error
+        void record(MethodStatsRole role, const Message& call, const Message& reply, std::chrono::nanoseconds latency) noexcept;
+
+        // Fills result with the statistics of every method, merged over all shards
+        void snapshot(std::vector<MethodStatsSnapshot>& result) const noexcept;
+
+        // The number of calls that were not recorded because the table of their shard was full
+        [[nodiscard]] uint64_t overflowed() const noexcept;
+
+        // Used by the send_with_reply path. track attaches the start of a call to its pending call, and complete records
+        // it once the reply is taken
+        void track(const Message& call, DBusPendingCall* pending, std::chrono::steady_clock::time_point start) noexcept;
+        static void complete(DBusPendingCall* pending, const Message& reply) noexcept;
+
+        ~MethodStats() noexcept;
+    private:
+        friend class MethodStatsScope;
+
+#define UDBUS_METHOD_STATS_KEY_SIZE 256
+
+        struct Entry
+        {
+            // 0 marks a free entry. Threads claim entries by swapping the hash in, then publish the key with bReady
+            std::atomic<uint64_t> hash = 0;
+            std::atomic<bool> bReady = false;
+
+            MethodStatsRole role = METHOD_STATS_CLIENT;
+            // "destination\0interface\0member\0", truncated to fit
+            char key[UDBUS_METHOD_STATS_KEY_SIZE]{};
+
+            std::atomic<uint64_t> count = 0;
+            std::atomic<uint64_t> errors = 0;
+            std::atomic<uint64_t> bytesIn = 0;
+            std::atomic<uint64_t> bytesOut = 0;
+            // Allocated when the entry is claimed, as most entries of most shards are never used
+            std::unique_ptr<Histogram> latency{};
+        };
+
+        struct PendingRecord
+        {
+            Entry* entry = nullptr;
+            std::chrono::steady_clock::time_point start{};
+            uint64_t bytesOut = 0;
+            bool bCountBytes = false;
+        };
+
+        static size_t messageSize(const Message& message) noexcept;
+
+        Entry* find(MethodStatsRole role, const Message& call) noexcept;
+        static void add(Entry* entry, std::chrono::nanoseconds latency, uint64_t bytesIn, uint64_t bytesOut, bool bError) noexcept;
+
+        std::vector<std::unique_ptr<Entry[]>> shards{};
+        size_t mask = 0;
+        bool bCountBytes = false;
+        std::atomic<uint64_t> overflowedCalls = 0;
+    };
+
+    // Records the time it takes to handle an incoming method call, from construction to destruction. As incoming calls
+    // are dispatched by the application, this is the only way server-side calls end up in a MethodStats:
+    // {
+    //     MethodStatsScope scope(&stats, call);
+    //     ...
+    //     scope.set_reply(reply);
+    //     connection.send(reply, nullptr);
+    // }
+    class MethodStatsScope
+    {
+    public:
+        // stats may be nullptr, in which case nothing is recorded
+        MethodStatsScope(MethodStats* stats, const Message& call) noexcept;
+
+        MethodStatsScope(const MethodStatsScope&) = delete;
+        MethodStatsScope& operator=(const MethodStatsScope&) = delete;
+
+        // Counts the bytes of the reply. Error replies count as errors
+        void set_reply(const Message& reply) noexcept;
+        void set_error() noexcept;
+
+        ~MethodStatsScope() noexcept;
+    private:
+        MethodStats* stats = nullptr;
+        MethodStats::Entry* entry = nullptr;
+        std::chrono::steady_clock::time_point start{};
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+        bool bError = false;
+    };
+
+    // Connection-level counters, attached with Connection::set_connection_stats. All counters are atomics, so they can
+    // be read from any thread, e.g. by a PrometheusExporter. The statistics must outlive every connection they are
+    // attached to, as well as every pending call made on them.
+    class ConnectionStats
+    {
+    public:
+        // Messages have no size getter, so counting bytes marshals every message, which costs a full copy of each.
+        // Without it bytes_sent and bytes_received stay at 0
+        explicit ConnectionStats(bool bCountBytes = false) noexcept;
+
+        ConnectionStats(const ConnectionStats&) = delete;
+        ConnectionStats& operator=(const ConnectionStats&) = delete;
+
+        // Called by Connection
+        void sent(const Message& message) noexcept;
+        void received(const Message& message) noexcept;
+        // Counts a pending call until it is freed, and its reply as received once it is taken with
+        // Message::pending_call_steal_reply
+        void track(DBusPendingCall* pending) noexcept;
+        static void complete(DBusPendingCall* pending, const Message& reply) noexcept;
+        void begin_blocking_call() noexcept;
+        void end_blocking_call() noexcept;
+
+        [[nodiscard]] uint64_t messages_sent() const noexcept;
+        [[nodiscard]] uint64_t messages_received() const noexcept;
+        [[nodiscard]] uint64_t bytes_sent() const noexcept;
+        [[nodiscard]] uint64_t bytes_received() const noexcept;
+        // The number of calls that are waiting for a reply
+        [[nodiscard]] uint64_t pending_calls() const noexcept;
+
+        ~ConnectionStats() noexcept;
+    private:
+        bool bCountBytes = false;
+        std::atomic<uint64_t> messagesSent = 0;
+        std::atomic<uint64_t> messagesReceived = 0;
+        std::atomic<uint64_t> bytesSent = 0;
+        std::atomic<uint64_t> bytesReceived = 0;
+        std::atomic<uint64_t> pendingCalls = 0;
+    };
+
+    // Renders the statistics of connections in the Prometheus text exposition format, either into a buffer or over a
+    // local socket that a Prometheus server scrapes. Besides the ConnectionStats counters, it exports the outgoing
+    // queue of every connection, whether it has messages waiting to be dispatched and the process-wide decode errors.
+    //
+    // The connections and statistics must outlive the exporter.
+    class PrometheusExporter
+    {
+    public:
+        PrometheusExporter() = default;
+
+        PrometheusExporter(const PrometheusExporter&) = delete;
+        PrometheusExporter& operator=(const PrometheusExporter&) = delete;
+
+        // Adds a connection to the export, labelled with connection="name". Not thread-safe, add all connections
+        // before calling serve
+        void add(const char* name, const Connection& connection, const ConnectionStats& stats) noexcept;
+
+        /**
+         * @brief Renders all metrics into a caller-provided buffer
+         * @param buffer - The buffer to render into. Always null-terminated if size is not 0
+         * @param size - The size of the buffer
+         * @return The length of the full output, without the terminator. If it is not smaller than size, the output
+         * was truncated, like with snprintf
+         */
+        size_t render(char* buffer, size_t size) const noexcept;
+
+        /**
+         * @brief Serves the metrics over HTTP from a background thread, answering every request with the rendered
+         * metrics
+         * @param address - Either "unix:path=/path/to/socket" or "tcp:host=127.0.0.1,port=9100"
+         * @param error - Set if the socket could not be opened
+         */
+        void serve(const char* address, Error& error) noexcept;
+        void stop() noexcept;
+
+        ~PrometheusExporter() noexcept;
+    private:
+        struct Target
+        {
+            // Escaped for use as a label value
+            std::string name{};
+            const Connection* connection = nullptr;
+            const ConnectionStats* stats = nullptr;
+        };
+
+        void run() noexcept;
+
+        std::vector<Target> targets{};
+
+        int listener = -1;
+        std::string socketPath{};
+        std::atomic<bool> bRunning = false;
+        std::thread server{};
+    };
+
+    enum FlightDirection
+    {
+        FLIGHT_OUTGOING,
+        FLIGHT_INCOMING,
+    };
+
+    // An always-on, in-memory record of the most recent messages of one or more connections, for postmortem debugging
+    // when running dbus-monitor would be too expensive. Attach it with Connection::set_flight_recorder. For every
+    // message it records the time, direction, type, serials and header fields, and optionally a prefix of the
+    // marshalled message.
+    //
+    // The records live in a ring of fixed-size slots within a fixed memory budget, so old records are overwritten.
+    // Every slot is a seqlock that writers claim with a CAS, so recording is lock-free and readers never see torn
+    // records. A writer that finds its slot still being written by a thread that lapped it drops its record instead of
+    // waiting. The recorder must outlive every connection it is attached to.
+    class FlightRecorder
+    {
+    public:
+        /**
+         * @brief Allocates the ring
+         * @param budget - The memory budget in bytes, which determines the number of records that are kept
+         * @param bodyPrefix - The number of bytes of the marshalled message to keep. 0 disables marshalling, which also
+         * leaves the size of the records at 0, as messages have no size getter
+         */
+        explicit FlightRecorder(size_t budget = 1024 * 1024, size_t bodyPrefix = 0) noexcept;
+
+        FlightRecorder(const FlightRecorder&) = delete;
+        FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+        void record(const Message& message, FlightDirection direction) noexcept;
+
+        // Used by the send_with_reply path, records the reply once it is taken with Message::pending_call_steal_reply
+        void track(DBusPendingCall* pending) noexcept;
+        static void complete(DBusPendingCall* pending, const Message& reply) noexcept;
+
+        // Writes the records to a file descriptor as text, oldest first. Does not allocate, so it can be called from a
+        // signal handler. Returns the number of written records
+        size_t dump(int fd) const noexcept;
+
+        // Dumps this recorder to fd when the process receives SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT, before the
+        // signal is handled as usual. Up to 8 recorders can be registered
+        bool dump_on_crash(int fd) noexcept;
+
+        // The number of slots in the ring
+        [[nodiscard]] size_t capacity() const noexcept;
+        // The number of records dropped because their slot was busy
+        [[nodiscard]] uint64_t dropped() const noexcept;
+
+        ~FlightRecorder() noexcept;
+    private:
+#define UDBUS_FLIGHT_RECORDER_HEADER_SIZE 192
+
+        struct Record
+        {
+            // Wall clock time in nanoseconds, so that records can be matched with logs
+            uint64_t timestamp = 0;
+            dbus_uint32_t serial = 0;
+            dbus_uint32_t replySerial = 0;
+            uint32_t size = 0;
+            uint32_t bodyLength = 0;
+            uint8_t type = 0;
+            uint8_t direction = 0;
+            // "sender\0destination\0path\0interface\0member\0signature\0", truncated to fit
+            char header[UDBUS_FLIGHT_RECORDER_HEADER_SIZE]{};
+        };
+
+        struct Slot
+        {
+            // Odd while a writer is filling the slot, 2 * (index + 1) once record number index is complete
+            std::atomic<uint64_t> sequence = 0;
+            Record record{};
+        };
+
+        std::unique_ptr<Slot[]> slots{};
+        std::unique_ptr<uint8_t[]> bodies{};
+        size_t count = 0;
+        size_t bodyPrefix = 0;
+
+        std::atomic<uint64_t> head = 0;
+        std::atomic<uint64_t> droppedRecords = 0;
+    };
+
+    // Streams every message sent and received on one or more connections to a pcap file with the D-Bus link type, the
+    // same format as dbus-monitor --pcap, which Wireshark can read. Attach it with Connection::set_pcap_writer.
+    //
+    // Capturing only takes a reference to the message and queues it with its timestamp. A background thread then
+    // marshals the messages and writes them out through a buffered file, so the send and receive paths never wait for
+    // the disk. When the queue is full, messages are dropped instead of blocking. Received messages are locked when
+    // they are captured, like sent ones, so that the writer thread can marshal them while they are in use; they can
+    // no longer be modified afterwards. The writer must outlive every connection it is attached to.
+    class PcapWriter
+    {
+    public:
+        /**
+         * @brief Sets up the writer, call open to start capturing
+         * @param capacity - The maximum number of queued messages, captures beyond it are dropped
+         */
+        explicit PcapWriter(size_t capacity = 65536) noexcept;
+
+        PcapWriter(const PcapWriter&) = delete;
+        PcapWriter& operator=(const PcapWriter&) = delete;
+
+        // Creates the file, writes the pcap header and starts the writer thread
+        bool open(const char* path, Error& error) noexcept;
+        // Writes out every queued message, stops the writer thread and closes the file
+        void close() noexcept;
+
+        void capture(const Message& message) noexcept;
+
+        // Used by the send_with_reply path, captures the reply once it is taken with Message::pending_call_steal_reply
+        void track(DBusPendingCall* pending) noexcept;
+        static void complete(DBusPendingCall* pending, const Message& reply) noexcept;
+
+        // The number of messages written to the file
+        [[nodiscard]] uint64_t written() const noexcept;
+        // The number of messages dropped because the queue was full or they could not be marshalled
+        [[nodiscard]] uint64_t dropped() const noexcept;
+
+        ~PcapWriter() noexcept;
+    private:
+        struct Capture
+        {
+            DBusMessage* message = nullptr;
+            timespec timestamp{};
+        };
+
+        void run() noexcept;
+
+        std::mutex mutex{};
+        std::condition_variable condition{};
+        std::vector<Capture> queue{};
+        size_t capacity = 0;
+        bool bRunning = false;
+
+        FILE* file = nullptr;
+        std::thread writer{};
+
+        std::atomic<uint64_t> writtenMessages = 0;
+        std::atomic<uint64_t> droppedMessages = 0;
+    };
+
+    enum ReplayTiming
+    {
+        // Keeps the gaps between the messages as they were captured, scaled by ReplayOptions::speed
+        REPLAY_ORIGINAL,
+        // Sends ReplayOptions::rate messages per second
+        REPLAY_FIXED_RATE,
+        // Sends as soon as there is room in the window of calls in flight
+        REPLAY_AS_FAST_AS_POSSIBLE,
+    };
+
+    struct ReplayOptions
+    {
+        ReplayTiming timing = REPLAY_ORIGINAL;
+        double speed = 1.0;
+        double rate = 1000.0;
+        // Replaces the destination of every message, to point a capture at another instance of a service
+        const char* destination = nullptr;
+        // Only replays the messages of this sender. By default only messages without a sender are replayed, which in a
+        // capture of PcapWriter are the ones the capturing connection sent, while received ones carry the name of their
+        // sender. In captures of dbus-monitor every message has a sender, so set it to the unique name of the client
+        // whose traffic should be replayed
+        const char* sender = nullptr;
+        // The maximum number of method calls waiting for a reply. Sending pauses while the window is full
+        size_t window = 256;
+        int timeoutMilliseconds = DBUS_TIMEOUT_USE_DEFAULT;
+    };
+
+    struct ReplayResult
+    {
+        // Method calls and signals that were sent
+        uint64_t sent = 0;
+        // Replies received, including error replies
+        uint64_t replies = 0;
+        // Calls that could not be sent, timed out or got an error reply
+        uint64_t errors = 0;
+        // Replies, errors and Hello calls of the capture, which cannot be replayed, and messages of other senders
+        uint64_t skipped = 0;
+        std::chrono::nanoseconds elapsed{};
+        // The time between sending each call and receiving its reply, in nanoseconds
+        Histogram latency{};
+    };
+
+    // Re-sends captured traffic to a connection, to reproduce production load against another build of a service.
+    // Captures are either pcap files with the D-Bus link type, as written by PcapWriter and dbus-monitor --pcap, or the
+    // compact format written by save: an 8 byte "UDBUSRPL" magic followed by records made of a 64 bit timestamp in
+    // nanoseconds, a 32 bit length and the marshalled message, all in host byte order.
+    //
+    // Every message is copied before it is sent, which gives it a new serial. Method calls get their replies through
+    // the window of pending calls, so the replay dispatches the connection while it runs.
+    class Replay
+    {
+    public:
+        Replay() = default;
+
+        // Replaces the loaded messages with the ones of a capture file
+        bool load(const char* path, Error& error) noexcept;
+        // Writes the loaded messages in the compact format
+        bool save(const char* path, Error& error) const noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+
+        // Sends every loaded method call and signal of the sender selected by the options, and waits for the replies of
+        // all calls
+        bool run(const Connection& connection, const ReplayOptions& options, ReplayResult& result, Error& error) const noexcept;
+    private:
+        struct Entry
+        {
+            Message message{};
+            uint64_t timestamp = 0;
+        };
+
+        bool add(const char* data, size_t length, uint64_t timestamp, Error& error) noexcept;
+
+        std::vector<Entry> entries{};
+    };
+}
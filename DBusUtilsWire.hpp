@@ -0,0 +1,210 @@
+// This file contains the native marshaller, which writes Type and Struct schemas straight into the D-Bus wire format
+// instead of going through the libdbus iterators.
+#pragma once
+#include "DBusUtils.hpp"
+#include <bit>
+#include <cstring>
+
+namespace UDBus
+{
+    // Builds the body of a message from the same Type/Struct schemas that Message::handleMessage reads into. Where
+    // MessageBuilder makes a libdbus iterator call per value, this writes the whole body into one buffer with the
+    // alignment, padding and array lengths of the wire format, and turns it into a message with a single
+    // dbus_message_demarshal, which also validates it. For large structured payloads that is several times faster. Bodies
+    // that are mostly one big array of numbers are better left to MessageBuilder, which hands them to libdbus in a
+    // single call, while this copies them twice more on the way to the message.
+    //
+    // Supported are basic types, strings, arrays (including arrays of structs), maps and nested structs. Variants can
+    // not be written, as Variant only knows how to parse its contents. IgnoreType and BumpType fields are skipped.
+    //
+    // The buffers are reused between builds, so keep the marshaller around when building many messages.
+    class NativeMarshaller
+    {
+    public:
+        NativeMarshaller() noexcept = default;
+
+        /**
+         * @brief Replaces the message with a copy that has the schema as its body
+         * @param message - A message created with one of the new functions and an empty body. Its header fields and
+         * flags are kept
+         * @param t - The values to write
+         * @param error - Set if the message already has a body or the result is not a valid message
+         * @return Whether the message was built
+         */
+        template<typename T, typename... T2>
+        bool build(Message& message, Type<T, T2...>& t, Error& error) noexcept
+        {
+            static const std::string signature = signatureOf<Type<T, T2...>>();
+            if (!beginMessage(message, signature, error))
+                return false;
+            writeFields(t);
+            return endMessage(message, error);
+        }
+    private:
+        // Starts the wire buffer with the header of the message, leaving the body length to be filled in by endMessage
+        bool beginMessage(const Message& message, const std::string& signature, Error& error) noexcept;
+        bool endMessage(Message& message, Error& error) noexcept;
+
+        std::vector<uint8_t> wire{};
+        size_t bodyStart = 0;
+
+        void align(const size_t alignment) noexcept
+        {
+            wire.resize((wire.size() + alignment - 1) & ~(alignment - 1), 0);
+        }
+
+        template<typename V>
+        void put(const V& value) noexcept
+        {
+            align(sizeof(V));
+            const size_t offset = wire.size();
+            wire.resize(offset + sizeof(V));
+            memcpy(wire.data() + offset, &value, sizeof(V));
+        }
+
+        void putString(const char* str) noexcept
+        {
+            const auto length = static_cast<uint32_t>(str == nullptr ? 0 : strlen(str));
+            put(length);
+            const size_t offset = wire.size();
+            wire.resize(offset + length + 1);
+            if (length > 0)
+                memcpy(wire.data() + offset, str, length);
+            wire[offset + length] = '\0';
+        }
+
+        template<typename TT>
+        static constexpr bool isSkipped() noexcept
+        {
+            return std::is_same_v<IgnoreType, TT> || std::is_same_v<BumpType, TT>;
+        }
+
+        // The alignment of a type on the wire, which is also the alignment of the first element of an array of it
+        template<typename TT>
+        static constexpr size_t alignmentOf() noexcept
+        {
+            if constexpr (is_specialisation_of<Struct, TT>{} || is_map_type<TT>)
+                return 8;
+            else if constexpr (is_array_type<TT>)
+                return 4;
+            else if constexpr (Tag<TT>::TypeString == DBUS_TYPE_STRING || std::is_same_v<udbus_bool_t, TT>)
+                return 4;
+            else
+                return sizeof(TT);
+        }
+
+        template<typename TT, typename... TT2>
+        static void appendSignatures(std::string& signature, const Type<TT, TT2...>*) noexcept
+        {
+            if constexpr (!isSkipped<TT>())
+                signature += signatureOf<TT>();
+            if constexpr (sizeof...(TT2) > 0)
+                appendSignatures(signature, static_cast<const Type<TT2...>*>(nullptr));
+        }
+
+        template<typename TT>
+        static std::string signatureOf() noexcept
+        {
+            static_assert(!std::is_same_v<Variant, TT> && !is_specialisation_of<ContainerVariantTemplate, TT>{},
+                          "Variants can only be parsed, they can not be written by the native marshaller");
+
+            std::string signature;
+            if constexpr (is_specialisation_of<Type, TT>{})
+                appendSignatures(signature, static_cast<const TT*>(nullptr));
+            else if constexpr (is_specialisation_of<Struct, TT>{})
+            {
+                signature += DBUS_STRUCT_BEGIN_CHAR;
+                appendSignatures(signature, static_cast<const TT*>(nullptr));
+                signature += DBUS_STRUCT_END_CHAR;
+            }
+            else if constexpr (is_map_type<TT>)
+            {
+                signature += DBUS_TYPE_ARRAY;
+                signature += DBUS_DICT_ENTRY_BEGIN_CHAR;
+                signature += signatureOf<typename TT::key_type>();
+                signature += signatureOf<typename TT::mapped_type>();
+                signature += DBUS_DICT_ENTRY_END_CHAR;
+            }
+            else if constexpr (is_array_type<TT>)
+            {
+                signature += DBUS_TYPE_ARRAY;
+                signature += signatureOf<typename TT::value_type>();
+            }
+            else
+                signature += Tag<TT>::TypeString;
+            return signature;
+        }
+
+        template<typename TT, typename... TT2>
+        void writeFields(const Type<TT, TT2...>& t) noexcept
+        {
+            if constexpr (!isSkipped<TT>())
+                writeValue(*t.data);
+            if constexpr (sizeof...(TT2) > 0)
+                writeFields(t.n);
+        }
+
+        template<typename TT>
+        void writeValue(const TT& value) noexcept
+        {
+            if constexpr (is_specialisation_of<Struct, TT>{})
+            {
+                align(8);
+                writeFields(value);
+            }
+            else if constexpr (is_map_type<TT>)
+            {
+                const size_t length = beginArray(8);
+                const size_t start = wire.size();
+                for (const auto& [key, mapped] : value)
+                {
+                    align(8);
+                    writeValue(key);
+                    writeValue(mapped);
+                }
+                endArray(length, start);
+            }
+            else if constexpr (is_array_type<TT>)
+            {
+                using Element = typename TT::value_type;
+                const size_t length = beginArray(alignmentOf<Element>());
+                const size_t start = wire.size();
+                // Fixed size numbers have the same layout in memory and on the wire
+                if constexpr (std::is_arithmetic_v<Element>)
+                {
+                    wire.resize(start + value.size() * sizeof(Element));
+                    if (!value.empty())
+                        memcpy(wire.data() + start, value.data(), value.size() * sizeof(Element));
+                }
+                else
+                {
+                    for (const auto& a : value)
+                        writeValue(a);
+                }
+                endArray(length, start);
+            }
+            else if constexpr (Tag<TT>::TypeString == DBUS_TYPE_STRING)
+                putString(value);
+            else if constexpr (std::is_same_v<udbus_bool_t, TT>)
+                put(static_cast<dbus_uint32_t>(value.b != 0));
+            else
+                put(value);
+        }
+
+        // Writes a placeholder for the length of an array and the padding before its first element. The length does not
+        // include that padding
+        size_t beginArray(const size_t elementAlignment) noexcept
+        {
+            put(static_cast<uint32_t>(0));
+            const size_t length = wire.size() - sizeof(uint32_t);
+            align(elementAlignment);
+            return length;
+        }
+
+        void endArray(const size_t length, const size_t start) noexcept
+        {
+            const auto size = static_cast<uint32_t>(wire.size() - start);
+            memcpy(wire.data() + length, &size, sizeof(size));
+        }
+    };
+}
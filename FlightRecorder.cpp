@@ -0,0 +1,263 @@
+#include "DBusUtilsStats.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <unistd.h>
+
+// Marks the pending calls whose connection has a flight recorder, holding a pointer to it
+static dbus_int32_t pendingSlot = -1;
+
+#define UDBUS_FLIGHT_RECORDER_CRASH_TARGETS 8
+
+struct CrashTarget
+{
+    std::atomic<const UDBus::FlightRecorder*> recorder = nullptr;
+    int fd = -1;
+};
+
+static CrashTarget crashTargets[UDBUS_FLIGHT_RECORDER_CRASH_TARGETS];
+static const int crashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+static struct sigaction previousActions[sizeof(crashSignals) / sizeof(crashSignals[0])];
+
+static void crashHandler(const int signal) noexcept
+{
+    for (auto& a : crashTargets)
+    {
+        const auto* recorder = a.recorder.load(std::memory_order_acquire);
+        if (recorder != nullptr)
+            recorder->dump(a.fd);
+    }
+
+    // Hand the signal to whatever handled it before, so that core dumps and other crash reporters still work
+    for (size_t i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++)
+        sigaction(crashSignals[i], &previousActions[i], nullptr);
+    raise(signal);
+}
+
+// Writes "sender\0destination\0path\0interface\0member\0signature\0" into the header buffer. Strings that do not fit
+// are truncated, always leaving room for the terminators of the following strings
+static void writeHeader(char* header, const DBusMessage* message) noexcept
+{
+    auto* msg = const_cast<DBusMessage*>(message);
+    const char* fields[] = {
+        dbus_message_get_sender(msg),
+        dbus_message_get_destination(msg),
+        dbus_message_get_path(msg),
+        dbus_message_get_interface(msg),
+        dbus_message_get_member(msg),
+        dbus_message_get_signature(msg),
+    };
+
+    size_t offset = 0;
+    size_t remaining = sizeof(fields) / sizeof(fields[0]);
+    for (const char* str : fields)
+    {
+        const size_t length = str == nullptr ? 0 : std::min(strlen(str), UDBUS_FLIGHT_RECORDER_HEADER_SIZE - offset - remaining);
+        memcpy(header + offset, str, length);
+        header[offset + length] = '\0';
+        offset += length + 1;
+        remaining--;
+    }
+}
+
+static bool writeAll(const int fd, const char* data, size_t length) noexcept
+{
+    while (length > 0)
+    {
+        const auto written = write(fd, data, length);
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+UDBus::FlightRecorder::FlightRecorder(const size_t budget, const size_t bodyPrefix) noexcept
+{
+    this->bodyPrefix = bodyPrefix;
+    count = std::max<size_t>(budget / (sizeof(Slot) + bodyPrefix), 1);
+    slots = std::make_unique<Slot[]>(count);
+    if (bodyPrefix > 0)
+        bodies = std::make_unique<uint8_t[]>(count * bodyPrefix);
+
+    // Allocating a slot that is already allocated only increases its reference count, which is released in the
+    // destructor
+    dbus_pending_call_allocate_data_slot(&pendingSlot);
+}
+
+void UDBus::FlightRecorder::record(const Message& message, const FlightDirection direction) noexcept
+{
+    const uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = slots[index % count];
+
+    // Claim the slot. It is either still being written by a writer that this one lapped, or already holds a newer
+    // record if this writer was preempted for a whole lap; in both cases this record is the one that gets lost
+    uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) != 0 || sequence > 2 * index || !slot.sequence.compare_exchange_strong(sequence, 2 * index + 1, std::memory_order_relaxed))
+    {
+        droppedRecords.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // Orders the odd sequence before the writes below, for readers that check it again after copying
+    std::atomic_thread_fence(std::memory_order_release);
+
+    timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    auto& record = slot.record;
+    record.timestamp = static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+    record.serial = dbus_message_get_serial(message);
+    record.replySerial = dbus_message_get_reply_serial(message);
+    record.type = static_cast<uint8_t>(message.get_type());
+    record.direction = static_cast<uint8_t>(direction);
+    record.size = 0;
+    record.bodyLength = 0;
+    writeHeader(record.header, message);
+
+    char* data = nullptr;
+    int length = 0;
+    if (bodyPrefix > 0 && message.marshal(&data, &length))
+    {
+        record.size = static_cast<uint32_t>(length);
+        record.bodyLength = static_cast<uint32_t>(std::min(static_cast<size_t>(length), bodyPrefix));
+        memcpy(bodies.get() + (index % count) * bodyPrefix, data, record.bodyLength);
+        dbus_free(data);
+    }
+
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+void UDBus::FlightRecorder::track(DBusPendingCall* pending) noexcept
+{
+    if (pending != nullptr)
+        dbus_pending_call_set_data(pending, pendingSlot, this, nullptr);
+}
+
+void UDBus::FlightRecorder::complete(DBusPendingCall* pending, const Message& reply) noexcept
+{
+    if (pendingSlot < 0 || pending == nullptr || !reply.is_valid())
+        return;
+
+    auto* recorder = static_cast<FlightRecorder*>(dbus_pending_call_get_data(pending, pendingSlot));
+    if (recorder != nullptr)
+        recorder->record(reply, FLIGHT_INCOMING);
+}
+
+size_t UDBus::FlightRecorder::dump(const int fd) const noexcept
+{
+    // Everything is formatted into stack buffers, as the heap may be what crashed
+    char line[UDBUS_FLIGHT_RECORDER_HEADER_SIZE + 256];
+    char hex[129];
+    const uint64_t end = head.load(std::memory_order_acquire);
+    const uint64_t begin = end > count ? end - count : 0;
+
+    size_t written = 0;
+    for (uint64_t index = begin; index < end; index++)
+    {
+        const auto& slot = slots[index % count];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * index + 2)
+            continue;
+
+        Record record;
+        memcpy(&record, &slot.record, sizeof(record));
+        uint8_t body[64];
+        const size_t bodyLength = std::min<size_t>(record.bodyLength, bodyPrefix);
+        // The prefix is copied in chunks below, so only the first chunk is validated with the sequence; later chunks
+        // are checked again before they are written
+        memcpy(body, bodies.get() + (index % count) * bodyPrefix, std::min(bodyLength, sizeof(body)));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+            continue;
+
+        const char* sender = record.header;
+        const char* destination = sender + strlen(sender) + 1;
+        const char* path = destination + strlen(destination) + 1;
+        const char* interface = path + strlen(path) + 1;
+        const char* member = interface + strlen(interface) + 1;
+        const char* signature = member + strlen(member) + 1;
+
+        const int length = snprintf(line, sizeof(line), "%llu.%09llu %s %s serial=%u reply_serial=%u size=%u sender=%s destination=%s path=%s interface=%s member=%s signature=%s%s",
+                                    static_cast<unsigned long long>(record.timestamp / 1000000000ull), static_cast<unsigned long long>(record.timestamp % 1000000000ull),
+                                    record.direction == FLIGHT_OUTGOING ? "out" : "in", dbus_message_type_to_string(record.type),
+                                    record.serial, record.replySerial, record.size, sender, destination, path, interface, member, signature,
+                                    bodyLength > 0 ? " data=" : "");
+        if (length < 0 || !writeAll(fd, line, std::min(static_cast<size_t>(length), sizeof(line) - 1)))
+            return written;
+
+        for (size_t offset = 0; offset < bodyLength; offset += sizeof(body))
+        {
+            const size_t chunk = std::min(bodyLength - offset, sizeof(body));
+            if (offset > 0)
+            {
+                memcpy(body, bodies.get() + (index % count) * bodyPrefix + offset, chunk);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+                    break;
+            }
+            for (size_t i = 0; i < chunk; i++)
+            {
+                hex[2 * i] = "0123456789abcdef"[body[i] >> 4];
+                hex[2 * i + 1] = "0123456789abcdef"[body[i] & 0xf];
+            }
+            if (!writeAll(fd, hex, 2 * chunk))
+                return written;
+        }
+
+        if (!writeAll(fd, "\n", 1))
+            return written;
+        written++;
+    }
+    return written;
+}
+
+bool UDBus::FlightRecorder::dump_on_crash(const int fd) noexcept
+{
+    static std::mutex mutex;
+    static bool bInstalled = false;
+    std::lock_guard lock(mutex);
+    for (auto& a : crashTargets)
+    {
+        if (a.recorder.load(std::memory_order_relaxed) != nullptr)
+            continue;
+        // The fd is written before the recorder is published, which is what the handler checks
+        a.fd = fd;
+        a.recorder.store(this, std::memory_order_release);
+
+        if (!bInstalled)
+        {
+            bInstalled = true;
+            struct sigaction action{};
+            action.sa_handler = crashHandler;
+            sigemptyset(&action.sa_mask);
+            for (size_t i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++)
+                sigaction(crashSignals[i], &action, &previousActions[i]);
+        }
+        return true;
+    }
+    return false;
+}
+
+size_t UDBus::FlightRecorder::capacity() const noexcept
+{
+    return count;
+}
+
+uint64_t UDBus::FlightRecorder::dropped() const noexcept
+{
+    return droppedRecords.load(std::memory_order_relaxed);
+}
+
+UDBus::FlightRecorder::~FlightRecorder() noexcept
+{
+    for (auto& a : crashTargets)
+    {
+        const FlightRecorder* expected = this;
+        a.recorder.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+    }
+    dbus_pending_call_free_data_slot(&pendingSlot);
+}
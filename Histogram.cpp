@@ -0,0 +1,129 @@
+#include "DBusUtilsStats.hpp"
+#include <bit>
+
+#define SUB_BUCKETS (1ull << UDBUS_HISTOGRAM_SUB_BUCKET_BITS)
+#define HALF_SUB_BUCKETS (SUB_BUCKETS / 2)
+#define MAX_VALUE ((1ull << UDBUS_HISTOGRAM_MAX_BITS) - 1)
+
+UDBus::Histogram::Histogram() noexcept
+{
+    for (auto& a : buckets)
+        a.store(0, std::memory_order_relaxed);
+}
+
+size_t UDBus::Histogram::index(const uint64_t value) noexcept
+{
+    if (value < SUB_BUCKETS)
+        return value;
+
+    // Shift the value so that its top bits land in the upper half of the sub-buckets, [32, 64). Every shift is one
+    // power of 2 and gets its own group of 32 buckets
+    const auto shift = static_cast<size_t>(std::bit_width(value)) - UDBUS_HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift * HALF_SUB_BUCKETS) + (value >> shift);
+}
+
+uint64_t UDBus::Histogram::upperBound(const size_t index) noexcept
+{
+    if (index < SUB_BUCKETS)
+        return index;
+
+    const size_t shift = (index / HALF_SUB_BUCKETS) - 1;
+    const uint64_t mantissa = index - (shift * HALF_SUB_BUCKETS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void UDBus::Histogram::record(uint64_t value, const uint64_t count) noexcept
+{
+    if (value > MAX_VALUE)
+        value = MAX_VALUE;
+
+    buckets[index(value)].fetch_add(count, std::memory_order_relaxed);
+    total.fetch_add(count, std::memory_order_relaxed);
+    sum.fetch_add(value * count, std::memory_order_relaxed);
+
+    auto current = minimum.load(std::memory_order_relaxed);
+    while (value < current && !minimum.compare_exchange_weak(current, value, std::memory_order_relaxed));
+    current = maximum.load(std::memory_order_relaxed);
+    while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed));
+}
+
+void UDBus::Histogram::merge(const Histogram& other) noexcept
+{
+    for (size_t i = 0; i < UDBUS_HISTOGRAM_BUCKETS; i++)
+    {
+        const auto c = other.buckets[i].load(std::memory_order_relaxed);
+        if (c != 0)
+            buckets[i].fetch_add(c, std::memory_order_relaxed);
+    }
+    total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    const auto otherMin = other.minimum.load(std::memory_order_relaxed);
+    auto current = minimum.load(std::memory_order_relaxed);
+    while (otherMin < current && !minimum.compare_exchange_weak(current, otherMin, std::memory_order_relaxed));
+
+    const auto otherMax = other.maximum.load(std::memory_order_relaxed);
+    current = maximum.load(std::memory_order_relaxed);
+    while (otherMax > current && !maximum.compare_exchange_weak(current, otherMax, std::memory_order_relaxed));
+}
+
+void UDBus::Histogram::reset() noexcept
+{
+    for (auto& a : buckets)
+        a.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    minimum.store(UINT64_MAX, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
+
+uint64_t UDBus::Histogram::count() const noexcept
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::Histogram::min() const noexcept
+{
+    const auto result = minimum.load(std::memory_order_relaxed);
+    return result == UINT64_MAX ? 0 : result;
+}
+
+uint64_t UDBus::Histogram::max() const noexcept
+{
+    return maximum.load(std::memory_order_relaxed);
+}
+
+double UDBus::Histogram::mean() const noexcept
+{
+    const auto c = count();
+    return c == 0 ? 0.0 : static_cast<double>(sum.load(std::memory_order_relaxed)) / static_cast<double>(c);
+}
+
+uint64_t UDBus::Histogram::percentile(double percentage) const noexcept
+{
+    // Sum the buckets instead of using total, which may be slightly ahead of them while other threads are recording
+    uint64_t recorded = 0;
+    for (const auto& a : buckets)
+        recorded += a.load(std::memory_order_relaxed);
+    if (recorded == 0)
+        return 0;
+
+    percentage = percentage < 0.0 ? 0.0 : (percentage > 100.0 ? 100.0 : percentage);
+    auto target = static_cast<uint64_t>((percentage / 100.0) * static_cast<double>(recorded) + 0.5);
+    if (target == 0)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < UDBUS_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+        {
+            // The bucket bound may overshoot the largest value that was actually recorded
+            const auto bound = upperBound(i);
+            const auto largest = max();
+            return largest != 0 && bound > largest ? largest : bound;
+        }
+    }
+    return max();
+}
@@ -1,4 +1,5 @@
 #include "DBusUtils.hpp"
+#include <unistd.h>
 
 UDBus::Iterator::~Iterator()
 {
@@ -42,18 +43,23 @@ UDBus::Iterator::Iterator(UDBus::Message& message, const int type, const char* c
 
 bool UDBus::Iterator::append_basic(const int type, const void* value) noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_append_basic(&iterator, type, value);
 }
 
 bool UDBus::Iterator::append_fixed_array(const int element_type, const void* value, const int n_elements) noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_append_fixed_array(&iterator, element_type, value, n_elements);
 }
 
 void UDBus::Iterator::close_container() noexcept
 {
     if (inner != nullptr && iteratorType == APPEND_ITERATOR)
+    {
+        UDBUS_COUNT_ITERATOR_OPERATION();
         dbus_message_iter_close_container(&iterator, &inner->iterator);
+    }
     inner = nullptr;
     iteratorType = EMPTY;
 }
@@ -70,11 +76,13 @@ void UDBus::Iterator::abandon_container_if_open() noexcept
 
 bool UDBus::Iterator::has_next() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_has_next(&iterator);
 }
 
 bool UDBus::Iterator::next() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_next(&iterator);
 }
 
@@ -88,38 +96,50 @@ void UDBus::Iterator::setAppend(UDBus::Message& message, const int type, const c
     iteratorType = APPEND_ITERATOR;
     inner = &it;
     if (bInit)
+    {
+        UDBUS_COUNT_ITERATOR_OPERATION();
         dbus_message_iter_init_append(message, &iterator);
+    }
     if (inner != nullptr)
+    {
+        UDBUS_COUNT_ITERATOR_OPERATION();
         dbus_message_iter_open_container(&iterator, type, contained_signature, &inner->iterator);
+    }
 }
 
 int UDBus::Iterator::get_arg_type() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_get_arg_type(&iterator);
 }
 
 int UDBus::Iterator::get_element_type() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_get_element_type(&iterator);
 }
 
 void UDBus::Iterator::recurse() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     dbus_message_iter_recurse(&iterator, &inner->iterator);
 }
 
 void UDBus::Iterator::get_basic(void *value) noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     dbus_message_iter_get_basic(&iterator, value);
 }
 
 int UDBus::Iterator::get_element_count() noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     return dbus_message_iter_get_element_count(&iterator);
 }
 
 void UDBus::Iterator::get_fixed_array(void* value, int* n_elements) noexcept
 {
+    UDBUS_COUNT_ITERATOR_OPERATION();
     dbus_message_iter_get_fixed_array(&iterator, value, n_elements);
 }
 
@@ -128,7 +148,72 @@ void UDBus::Iterator::setGet(UDBus::Message& message, Iterator* it, const bool b
     iteratorType = GET_ITERATOR;
     inner = it;
     if (bInit)
+    {
+        UDBUS_COUNT_ITERATOR_OPERATION();
         dbus_message_iter_init(message, &iterator);
+    }
     else if (it != nullptr)
         recurse();
 }
+
+bool UDBus::Iterator::copy(DBusMessageIter* src, DBusMessageIter* dest) noexcept
+{
+    const int type = dbus_message_iter_get_arg_type(src);
+    if (dbus_type_is_basic(type))
+    {
+        DBusBasicValue value{};
+        dbus_message_iter_get_basic(src, &value);
+        const bool bResult = dbus_message_iter_append_basic(dest, type, &value);
+
+        // Getting a file descriptor duplicates it and appending it duplicates it again
+        if (type == DBUS_TYPE_UNIX_FD && value.fd >= 0)
+            close(value.fd);
+        return bResult;
+    }
+
+    DBusMessageIter srcChild;
+    DBusMessageIter destChild = DBUS_MESSAGE_ITER_INIT_CLOSED;
+    dbus_message_iter_recurse(src, &srcChild);
+
+    // Arrays and variants need the signature of their contents when opening the container. For arrays, it is taken
+    // from the signature of the array itself, so that empty arrays work too
+    char* signature = nullptr;
+    const char* containedSignature = nullptr;
+    if (type == DBUS_TYPE_ARRAY)
+    {
+        signature = dbus_message_iter_get_signature(src);
+        containedSignature = signature + 1;
+    }
+    else if (type == DBUS_TYPE_VARIANT)
+    {
+        signature = dbus_message_iter_get_signature(&srcChild);
+        containedSignature = signature;
+    }
+
+    bool bResult = dbus_message_iter_open_container(dest, type, containedSignature, &destChild);
+    const int elementType = type == DBUS_TYPE_ARRAY ? dbus_message_iter_get_element_type(src) : DBUS_TYPE_INVALID;
+    if (bResult && elementType != DBUS_TYPE_UNIX_FD && dbus_type_is_fixed(elementType))
+    {
+        // Arrays of fixed types are copied in one go. File descriptors are fixed too, but libdbus does not hand them
+        // out as an array, so they are copied one by one below
+        const void* data = nullptr;
+        int n = 0;
+        dbus_message_iter_get_fixed_array(&srcChild, &data, &n);
+        bResult = dbus_message_iter_append_fixed_array(&destChild, elementType, &data, n);
+    }
+    else
+    {
+        for (; bResult && dbus_message_iter_get_arg_type(&srcChild) != DBUS_TYPE_INVALID; dbus_message_iter_next(&srcChild))
+            bResult = copy(&srcChild, &destChild);
+    }
+
+    if (signature != nullptr)
+        dbus_free(signature);
+
+    if (!bResult)
+    {
+        dbus_message_iter_abandon_container_if_open(dest, &destChild);
+        return false;
+    }
+    return dbus_message_iter_close_container(dest, &destChild);
+}
@@ -1,5 +1,5 @@
 #include <ranges>
-#include "DBusUtils.hpp"
+#include "DBusUtilsStats.hpp"
 
 void UDBus::Message::setUserPointer(void* ptr) noexcept
 {
@@ -116,6 +116,11 @@ void UDBus::Message::demarshal(const char* str, const int len, DBusError* error)
     message = dbus_message_demarshal(str, len, error);
 }
 
+udbus_bool_t UDBus::Message::marshal(char** marshalled_data_p, int* len_p) const noexcept
+{
+    return dbus_message_marshal(message, marshalled_data_p, len_p);
+}
+
 UDBus::Message::operator DBusMessage*() const noexcept
 {
     return message;
@@ -124,6 +129,13 @@ UDBus::Message::operator DBusMessage*() const noexcept
 void UDBus::Message::pending_call_steal_reply(DBusPendingCall* pending) noexcept
 {
     message = dbus_pending_call_steal_reply(pending);
+    if (message != nullptr)
+        trace(TRACE_RECEIVE, message);
+    // Completes the call for the statistics, the flight recorder and the pcap writer of its connection, if it has any
+    MethodStats::complete(pending, *this);
+    ConnectionStats::complete(pending, *this);
+    FlightRecorder::complete(pending, *this);
+    PcapWriter::complete(pending, *this);
 }
 
 UDBus::Message::Message(DBusMessage* msg) noexcept
@@ -136,6 +148,11 @@ int UDBus::Message::get_type() const noexcept
     return dbus_message_get_type(message);
 }
 
+const UDBus::CodecStats& UDBus::Message::get_decode_stats() const noexcept
+{
+    return decodeStats;
+}
+
 const char* UDBus::Message::get_error_name() const noexcept
 {
     return dbus_message_get_error_name(message);
@@ -9,6 +9,9 @@ UDBus::MessageBuilder::MessageBuilder(Message& msg) noexcept
 void UDBus::MessageBuilder::setMessage(Message& msg) noexcept
 {
     this->message = &msg;
+    stats = {};
+    bFailed = false;
+    trace(TRACE_BUILD_BEGIN, msg);
     if (nodeStack.empty())
         nodeStack.push(&node);
 }
@@ -22,6 +25,7 @@ void UDBus::MessageBuilder::appendGenericBasic(char type, void* data) const noex
         {
             DBusMessageIter iter;
             dbus_message_iter_init_append(message->get(), &iter);
+            UDBUS_COUNT_ITERATOR_OPERATION();
             // Wondering why strings are handled like this? Check the comment in DBusUtils.hpp L156
             if (type == DBUS_TYPE_STRING)
             {
@@ -30,6 +34,7 @@ void UDBus::MessageBuilder::appendGenericBasic(char type, void* data) const noex
             }
             else
                 dbus_message_iter_append_basic(&iter, type, data);
+            UDBUS_COUNT_ITERATOR_OPERATION();
             return;
         }
 
@@ -65,6 +70,7 @@ void UDBus::MessageBuilder::appendArrayBasic(char type, void* data, size_t n, si
         if (message->iteratorStack.empty())
         {
             dbus_message_append_args(message->get(), DBUS_TYPE_ARRAY, type, &data, n, DBUS_TYPE_INVALID);
+            UDBUS_COUNT_ITERATOR_OPERATION();
             return;
         }
 
@@ -122,6 +128,19 @@ void UDBus::MessageBuilder::getSignature(AppendNode& node, std::string& signatur
     if (node.bIgnore && node.signature.empty())
         return;
 
+    // Arrays and variants already got the signature of their contents on EndArray and EndVariant. Walking their
+    // children again would add the type of every element of an array, and the contents of a variant twice
+    if (node.signature == DBUS_TYPE_ARRAY_AS_STRING)
+    {
+        signature += node.signature + node.innerSignature;
+        return;
+    }
+    if (node.signature == DBUS_TYPE_VARIANT_AS_STRING)
+    {
+        signature += node.signature;
+        return;
+    }
+
     // Append the type to the signature, except for structs where the actual signatures are wrapped in () or for dict
     // entries where they are wrapped in {}
     if (node.signature == DBUS_TYPE_STRUCT_AS_STRING)
@@ -131,17 +150,14 @@ void UDBus::MessageBuilder::getSignature(AppendNode& node, std::string& signatur
     else
         signature += node.signature;
 
-    // Variants need to get their own inner signature at any level
     for (auto& a : node.children)
-        getSignature(a, node.signature == DBUS_TYPE_VARIANT_AS_STRING ? node.innerSignature : signature);
+        getSignature(a, signature);
 
     // Close the signature string
     if (node.signature == DBUS_TYPE_STRUCT_AS_STRING)
         signature += DBUS_STRUCT_END_CHAR_AS_STRING;
     else if (node.signature == DBUS_TYPE_DICT_ENTRY_AS_STRING)
         signature += DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
-    else if (node.signature == DBUS_TYPE_ARRAY_AS_STRING)
-        signature += node.innerSignature;
 }
 
 #define BEGIN_GENERIC_STRUCTURE(type, typeString, containedSignature)               \
@@ -161,6 +177,7 @@ void UDBus::MessageBuilder::getSignature(AppendNode& node, std::string& signatur
 template <>
 UDBus::MessageBuilder& UDBus::MessageBuilder::append<UDBus::MessageManipulators>(const MessageManipulators& op) noexcept
 {
+    CodecScope scope(&stats);
     switch (op)
     {
     case BeginStruct:
@@ -186,10 +203,26 @@ UDBus::MessageBuilder& UDBus::MessageBuilder::append<UDBus::MessageManipulators>
         nodeStack.top()->innerSignature.clear();
         break;
     case EndArray:
-        for (auto& a : nodeStack.top()->children)
-            getSignature(a, nodeStack.top()->innerSignature);
+    {
+        // The contained signature is the type of a single element, which every element has to share. libdbus has to
+        // be given a valid one when the container is opened, it aborts the process otherwise
+        auto& array = *nodeStack.top();
+        std::string element;
+        for (auto& a : array.children)
+        {
+            element.clear();
+            getSignature(a, element);
+            if (array.innerSignature.empty())
+                array.innerSignature = element;
+            else if (element != array.innerSignature)
+                bFailed = true;
+        }
+        // An array without elements has no type to take the signature from
+        if (array.innerSignature.empty())
+            bFailed = true;
         endStructure();
         break;
+    }
 
 
     case BeginDictEntry:
@@ -201,7 +234,9 @@ UDBus::MessageBuilder& UDBus::MessageBuilder::append<UDBus::MessageManipulators>
         break;
 
     case EndMessage:
-        sendMessage(node);
+        if (!bFailed)
+            sendMessage(node);
+        trace(TRACE_BUILD_END, *message);
         break;
     default:
         break;
@@ -231,4 +266,14 @@ void UDBus::MessageBuilder::endStructure() noexcept
     });
     nodeStack.pop();
     layerDepth--;
-}
\ No newline at end of file
+}
+
+const UDBus::CodecStats& UDBus::MessageBuilder::get_stats() const noexcept
+{
+    return stats;
+}
+
+bool UDBus::MessageBuilder::failed() const noexcept
+{
+    return bFailed;
+}
@@ -1,4 +1,7 @@
 #include "DBusUtils.hpp"
+#include <atomic>
+
+static std::atomic<uint64_t> decodeErrors[UDBus::RESULT_INVALID_VARIANT_PARSING + 1]{};
 
 void UDBus::Message::setupContainer(UDBus::Iterator& it) noexcept
 {
@@ -49,4 +52,17 @@ UDBus::MessageGetResult UDBus::Message::handleVariants(UDBus::Iterator& current,
         return RESULT_INVALID_VARIANT_PARSING;
     endContainer(bInitialGet);
     return RESULT_SUCCESS;
-}
\ No newline at end of file
+}
+
+void UDBus::countDecodeError(const MessageGetResult result) noexcept
+{
+    if (result >= RESULT_SUCCESS && result <= RESULT_INVALID_VARIANT_PARSING)
+        decodeErrors[result].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t UDBus::getDecodeErrors(const MessageGetResult result) noexcept
+{
+    if (result >= RESULT_SUCCESS && result <= RESULT_INVALID_VARIANT_PARSING)
+        return decodeErrors[result].load(std::memory_order_relaxed);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "DBusUtilsSignals.hpp"
+
+UDBus::MessageLanes::MessageLanes(const size_t replyDepth, const size_t methodCallDepth, const size_t signalDepth, const LaneDropPolicy policy) noexcept
+{
+    depths[LANE_REPLIES] = replyDepth;
+    depths[LANE_METHOD_CALLS] = methodCallDepth;
+    depths[LANE_SIGNALS] = signalDepth;
+    this->policy = policy;
+}
+
+UDBus::MessageLane UDBus::MessageLanes::classify(const Message& message) noexcept
+{
+    switch (message.get_type())
+    {
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+    case DBUS_MESSAGE_TYPE_ERROR:
+        return LANE_REPLIES;
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+        return LANE_METHOD_CALLS;
+    default:
+        return LANE_SIGNALS;
+    }
+}
+
+size_t UDBus::MessageLanes::fill(const Connection& connection) noexcept
+{
+    size_t popped = 0;
+    while (true)
+    {
+        // Messages cannot be pushed back into the connection after they were popped, so stop as soon as any lane that
+        // must not drop messages is full
+        for (size_t i = 0; i < LANE_COUNT; i++)
+            if (lanes[i].size() >= depths[i] && (i != LANE_SIGNALS || policy == LANE_DROP_NONE))
+                return popped;
+
+        auto message = connection.pop_message();
+        if (!message.is_valid())
+            return popped;
+        popped++;
+
+        const auto lane = classify(message);
+        if (lane == LANE_SIGNALS && lanes[lane].size() >= depths[lane])
+        {
+            droppedSignals++;
+            if (policy == LANE_DROP_NEWEST)
+                continue;
+            lanes[lane].pop_front();
+        }
+        lanes[lane].push_back(std::move(message));
+    }
+}
+
+UDBus::Message UDBus::MessageLanes::pop_message() noexcept
+{
+    for (auto& a : lanes)
+    {
+        if (!a.empty())
+        {
+            auto message = std::move(a.front());
+            a.pop_front();
+            return message;
+        }
+    }
+    return Message{};
+}
+
+size_t UDBus::MessageLanes::size(const MessageLane lane) const noexcept
+{
+    return lanes[lane].size();
+}
+
+size_t UDBus::MessageLanes::size() const noexcept
+{
+    size_t result = 0;
+    for (const auto& a : lanes)
+        result += a.size();
+    return result;
+}
+
+size_t UDBus::MessageLanes::dropped() const noexcept
+{
+    return droppedSignals;
+}
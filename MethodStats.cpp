@@ -0,0 +1,281 @@
+#include "DBusUtilsStats.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+// Shared by all MethodStats instances, as it only marks the pending calls that are being tracked
+static dbus_int32_t pendingSlot = -1;
+
+static uint64_t hashKey(const UDBus::MethodStatsRole role, const char* destination, const char* interface, const char* member) noexcept
+{
+    // FNV-1a over the role and the three strings, including their terminators so that "a.b" + "c" differs from "a" + "b.c"
+    uint64_t hash = 14695981039346656037ull ^ static_cast<uint64_t>(role);
+    for (const char* str : { destination, interface, member })
+    {
+        for (const char* c = str; ; c++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+            if (*c == '\0')
+                break;
+        }
+    }
+    // 0 marks free entries
+    return hash == 0 ? 1 : hash;
+}
+
+// Writes "destination\0interface\0member\0" into the key buffer. Strings that do not fit are truncated, always leaving
+// room for the terminators of the following strings
+static void writeKey(char* key, const char* destination, const char* interface, const char* member) noexcept
+{
+    size_t offset = 0;
+    size_t remaining = 3;
+    for (const char* str : { destination, interface, member })
+    {
+        const size_t length = std::min(strlen(str), UDBUS_METHOD_STATS_KEY_SIZE - offset - remaining);
+        memcpy(key + offset, str, length);
+        key[offset + length] = '\0';
+        offset += length + 1;
+        remaining--;
+    }
+}
+
+static bool keyEquals(const char* key, const char* destination, const char* interface, const char* member) noexcept
+{
+    char expected[UDBUS_METHOD_STATS_KEY_SIZE]{};
+    writeKey(expected, destination, interface, member);
+    return memcmp(key, expected, UDBUS_METHOD_STATS_KEY_SIZE) == 0;
+}
+
+static const char* orEmpty(const char* str) noexcept
+{
+    return str == nullptr ? "" : str;
+}
+
+UDBus::MethodStats::MethodStats(const size_t shards, const size_t capacity, const bool bCountBytes) noexcept
+{
+    const size_t size = std::bit_ceil(capacity < 8 ? 8 : capacity);
+    mask = size - 1;
+    this->bCountBytes = bCountBytes;
+    for (size_t i = 0; i < (shards == 0 ? 1 : shards); i++)
+        this->shards.push_back(std::make_unique<Entry[]>(size));
+
+    // Allocating a slot that is already allocated only increases its reference count, which is released in the
+    // destructor
+    dbus_pending_call_allocate_data_slot(&pendingSlot);
+}
+
+size_t UDBus::MethodStats::messageSize(const Message& message) noexcept
+{
+    char* data = nullptr;
+    int length = 0;
+    if (!message.is_valid() || !message.marshal(&data, &length))
+        return 0;
+    dbus_free(data);
+    return static_cast<size_t>(length);
+}
+
+UDBus::MethodStats::Entry* UDBus::MethodStats::find(const MethodStatsRole role, const Message& call) noexcept
+{
+    // Threads get sequential ids instead of hashing their std::thread::id, so they are spread evenly over the shards
+    static std::atomic<size_t> threadCount = 0;
+    thread_local const size_t threadID = threadCount++;
+    auto* entries = shards[threadID % shards.size()].get();
+
+    const char* destination = orEmpty(dbus_message_get_destination(call));
+    const char* interface = orEmpty(dbus_message_get_interface(call));
+    const char* member = orEmpty(dbus_message_get_member(call));
+    const auto hash = hashKey(role, destination, interface, member);
+
+    for (size_t probes = 0, i = hash & mask; probes <= mask; probes++, i = (i + 1) & mask)
+    {
+        auto& entry = entries[i];
+        auto current = entry.hash.load(std::memory_order_acquire);
+        if (current == 0)
+        {
+            if (entry.hash.compare_exchange_strong(current, hash, std::memory_order_acq_rel))
+            {
+                entry.role = role;
+                writeKey(entry.key, destination, interface, member);
+                entry.latency = std::make_unique<Histogram>();
+                entry.bReady.store(true, std::memory_order_release);
+                return &entry;
+            }
+            // Another thread of the same shard claimed the entry first, current now holds its hash
+        }
+
+        if (current == hash)
+        {
+            // The thread that claimed the entry is still writing the key
+            while (!entry.bReady.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            if (entry.role == role && keyEquals(entry.key, destination, interface, member))
+                return &entry;
+        }
+    }
+
+    overflowedCalls.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void UDBus::MethodStats::add(Entry* entry, const std::chrono::nanoseconds latency, const uint64_t bytesIn, const uint64_t bytesOut, const bool bError) noexcept
+{
+    entry->count.fetch_add(1, std::memory_order_relaxed);
+    if (bError)
+        entry->errors.fetch_add(1, std::memory_order_relaxed);
+    entry->bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+    entry->bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+    entry->latency->record(latency.count() < 0 ? 0 : static_cast<uint64_t>(latency.count()));
+}
+
+void UDBus::MethodStats::record(const MethodStatsRole role, const Message& call, const Message& reply, const std::chrono::nanoseconds latency) noexcept
+{
+    auto* entry = find(role, call);
+    if (entry == nullptr)
+        return;
+
+    const bool bError = !reply.is_valid() || reply.get_type() == DBUS_MESSAGE_TYPE_ERROR;
+    uint64_t callSize = 0;
+    uint64_t replySize = 0;
+    if (bCountBytes)
+    {
+        callSize = messageSize(call);
+        replySize = messageSize(reply);
+    }
+
+    if (role == METHOD_STATS_CLIENT)
+        add(entry, latency, replySize, callSize, bError);
+    else
+        add(entry, latency, callSize, replySize, bError);
+}
+
+void UDBus::MethodStats::track(const Message& call, DBusPendingCall* pending, const std::chrono::steady_clock::time_point start) noexcept
+{
+    auto* entry = find(METHOD_STATS_CLIENT, call);
+    if (entry == nullptr || pending == nullptr)
+        return;
+
+    auto* record = new PendingRecord{
+        .entry = entry,
+        .start = start,
+        .bytesOut = bCountBytes ? messageSize(call) : 0,
+        .bCountBytes = bCountBytes,
+    };
+    if (!dbus_pending_call_set_data(pending, pendingSlot, record, [](void* data) -> void { delete static_cast<PendingRecord*>(data); }))
+        delete record;
+}
+
+void UDBus::MethodStats::complete(DBusPendingCall* pending, const Message& reply) noexcept
+{
+    if (pendingSlot < 0 || pending == nullptr)
+        return;
+
+    auto* record = static_cast<PendingRecord*>(dbus_pending_call_get_data(pending, pendingSlot));
+    if (record == nullptr)
+        return;
+
+    const auto latency = std::chrono::steady_clock::now() - record->start;
+    const bool bError = !reply.is_valid() || reply.get_type() == DBUS_MESSAGE_TYPE_ERROR;
+    add(record->entry, std::chrono::duration_cast<std::chrono::nanoseconds>(latency), record->bCountBytes ? messageSize(reply) : 0, record->bytesOut, bError);
+
+    // Frees the record, so that a second steal does not count the call again
+    dbus_pending_call_set_data(pending, pendingSlot, nullptr, nullptr);
+}
+
+void UDBus::MethodStats::snapshot(std::vector<MethodStatsSnapshot>& result) const noexcept
+{
+    result.clear();
+    std::vector<std::unique_ptr<Histogram>> latencies;
+    std::unordered_map<std::string, size_t> indices;
+
+    for (const auto& shard : shards)
+    {
+        for (size_t i = 0; i <= mask; i++)
+        {
+            const auto& entry = shard[i];
+            if (!entry.bReady.load(std::memory_order_acquire))
+                continue;
+
+            const auto key = std::to_string(entry.role) + std::string(entry.key, UDBUS_METHOD_STATS_KEY_SIZE);
+            auto it = indices.find(key);
+            if (it == indices.end())
+            {
+                const char* destination = entry.key;
+                const char* interface = destination + strlen(destination) + 1;
+                const char* member = interface + strlen(interface) + 1;
+                it = indices.emplace(key, result.size()).first;
+
+                auto& a = result.emplace_back();
+                a.role = entry.role;
+                a.destination = destination;
+                a.interface = interface;
+                a.member = member;
+                latencies.push_back(std::make_unique<Histogram>());
+            }
+
+            auto& a = result[it->second];
+            a.count += entry.count.load(std::memory_order_relaxed);
+            a.errors += entry.errors.load(std::memory_order_relaxed);
+            a.bytesIn += entry.bytesIn.load(std::memory_order_relaxed);
+            a.bytesOut += entry.bytesOut.load(std::memory_order_relaxed);
+            latencies[it->second]->merge(*entry.latency);
+        }
+    }
+
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        const auto& latency = *latencies[i];
+        auto& a = result[i];
+        a.mean = latency.mean();
+        a.p50 = latency.percentile(50);
+        a.p90 = latency.percentile(90);
+        a.p99 = latency.percentile(99);
+        a.p999 = latency.percentile(99.9);
+        a.max = latency.max();
+    }
+}
+
+uint64_t UDBus::MethodStats::overflowed() const noexcept
+{
+    return overflowedCalls.load(std::memory_order_relaxed);
+}
+
+UDBus::MethodStats::~MethodStats() noexcept
+{
+    dbus_pending_call_free_data_slot(&pendingSlot);
+}
+
+UDBus::MethodStatsScope::MethodStatsScope(MethodStats* stats, const Message& call) noexcept
+{
+    this->stats = stats;
+    if (stats == nullptr)
+        return;
+
+    entry = stats->find(METHOD_STATS_SERVER, call);
+    if (entry != nullptr && stats->bCountBytes)
+        bytesIn = MethodStats::messageSize(call);
+    start = std::chrono::steady_clock::now();
+}
+
+void UDBus::MethodStatsScope::set_reply(const Message& reply) noexcept
+{
+    if (entry == nullptr)
+        return;
+
+    if (reply.get_type() == DBUS_MESSAGE_TYPE_ERROR)
+        bError = true;
+    if (stats->bCountBytes)
+        bytesOut = MethodStats::messageSize(reply);
+}
+
+void UDBus::MethodStatsScope::set_error() noexcept
+{
+    bError = true;
+}
+
+UDBus::MethodStatsScope::~MethodStatsScope() noexcept
+{
+    if (entry != nullptr)
+        stats->add(entry, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start), bytesIn, bytesOut, bError);
+}
@@ -0,0 +1,126 @@
+#include "DBusUtilsSignals.hpp"
+
+UDBus::NameOwnerCache::NameOwnerCache(const Connection& connection) noexcept
+{
+    this->connection = &connection;
+}
+
+bool UDBus::NameOwnerCache::track(const char* name, Error& error) noexcept
+{
+    if (names.contains(std::string_view(name)))
+        return true;
+
+    // Subscribe before resolving, so that no change is lost between the reply and the first signal
+    Name entry;
+    entry.rule = std::string("type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS "',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',arg0='") + name + "'";
+    dbus_bus_add_match(*connection, entry.rule.c_str(), error);
+    if (error.is_set())
+        return false;
+
+    Message message;
+    message.new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "GetNameOwner");
+    if (!message.is_valid() || !dbus_message_append_args(message, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+    {
+        dbus_bus_remove_match(*connection, entry.rule.c_str(), nullptr);
+        error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to create the GetNameOwner call");
+        return false;
+    }
+
+    Error callError;
+    const auto reply = connection->send_with_reply_and_block(message, DBUS_TIMEOUT_USE_DEFAULT, callError);
+    const char* owner = nullptr;
+    if (reply.is_valid() && !callError.is_set() && dbus_message_get_args(reply, nullptr, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID))
+        entry.owner = owner;
+    else if (!callError.is_set())
+    {
+        // The call did not fail, but the reply is missing or malformed
+        dbus_bus_remove_match(*connection, entry.rule.c_str(), nullptr);
+        error.set(DBUS_ERROR_INVALID_SIGNATURE, "GetNameOwner did not return a string");
+        return false;
+    }
+    else if (!callError.has_name(DBUS_ERROR_NAME_HAS_NO_OWNER))
+    {
+        // Having no owner is a perfectly valid state for a tracked name, anything else is an error
+        dbus_bus_remove_match(*connection, entry.rule.c_str(), nullptr);
+        Error::move(callError, error);
+        return false;
+    }
+
+    names.emplace(name, std::move(entry));
+    return true;
+}
+
+void UDBus::NameOwnerCache::untrack(const char* name) noexcept
+{
+    const auto it = names.find(std::string_view(name));
+    if (it == names.end())
+        return;
+    dbus_bus_remove_match(*connection, it->second.rule.c_str(), nullptr);
+    names.erase(it);
+}
+
+bool UDBus::NameOwnerCache::handleSignal(const Message& signal) noexcept
+{
+    if (!signal.is_signal(DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+        return false;
+
+    // Only trust the bus itself, anyone can emit a signal with the same interface and member
+    const char* sender = dbus_message_get_sender(signal);
+    if (sender != nullptr && std::string_view(sender) != DBUS_SERVICE_DBUS)
+        return false;
+
+    const char* name = nullptr;
+    const char* oldOwner = nullptr;
+    const char* newOwner = nullptr;
+    if (!dbus_message_get_args(signal, nullptr, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner, DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID))
+        return false;
+
+    const auto it = names.find(std::string_view(name));
+    if (it == names.end())
+        return false;
+
+    it->second.owner = newOwner;
+    if (handler)
+        handler(name, oldOwner, newOwner);
+    return true;
+}
+
+void UDBus::NameOwnerCache::set_handler(NameOwnerHandler handler) noexcept
+{
+    this->handler = std::move(handler);
+}
+
+const char* UDBus::NameOwnerCache::get_owner(const char* name) const noexcept
+{
+    // Unique names own themselves
+    if (name[0] == ':')
+        return name;
+
+    const auto it = names.find(std::string_view(name));
+    if (it == names.end() || it->second.owner.empty())
+        return nullptr;
+    return it->second.owner.c_str();
+}
+
+bool UDBus::NameOwnerCache::has_owner(const char* name) const noexcept
+{
+    return get_owner(name) != nullptr;
+}
+
+bool UDBus::NameOwnerCache::rewrite_destination(Message& message) const noexcept
+{
+    const char* destination = dbus_message_get_destination(message);
+    if (destination == nullptr)
+        return false;
+
+    const char* owner = get_owner(destination);
+    if (owner == nullptr)
+        return false;
+    return owner == destination || dbus_message_set_destination(message, owner);
+}
+
+UDBus::NameOwnerCache::~NameOwnerCache() noexcept
+{
+    for (const auto& a : names)
+        dbus_bus_remove_match(*connection, a.second.rule.c_str(), nullptr);
+}
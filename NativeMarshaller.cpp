@@ -0,0 +1,105 @@
+#include "DBusUtilsWire.hpp"
+
+// The fixed part of the header: byte order, type, flags, version, body length, serial and the length of the field array
+#define UDBUS_WIRE_FIXED_HEADER_SIZE 16
+
+bool UDBus::NativeMarshaller::beginMessage(const Message& message, const std::string& signature, Error& error) noexcept
+{
+    if (!message.is_valid())
+    {
+        error.set(DBUS_ERROR_INVALID_ARGS, "The message has to be created before its body is built");
+        return false;
+    }
+    if (dbus_message_get_signature(message)[0] != '\0')
+    {
+        error.set(DBUS_ERROR_INVALID_ARGS, "The message already has a body");
+        return false;
+    }
+
+    uint8_t flags = 0;
+    if (dbus_message_get_no_reply(message))
+        flags |= DBUS_HEADER_FLAG_NO_REPLY_EXPECTED;
+    if (!dbus_message_get_auto_start(message))
+        flags |= DBUS_HEADER_FLAG_NO_AUTO_START;
+    if (dbus_message_get_allow_interactive_authorization(message))
+        flags |= DBUS_HEADER_FLAG_ALLOW_INTERACTIVE_AUTHORIZATION;
+
+    wire.clear();
+    wire.push_back(std::endian::native == std::endian::little ? DBUS_LITTLE_ENDIAN : DBUS_BIG_ENDIAN);
+    wire.push_back(static_cast<uint8_t>(message.get_type()));
+    wire.push_back(flags);
+    wire.push_back(DBUS_MAJOR_PROTOCOL_VERSION);
+    // The body length is filled in by endMessage. The serial only has to be valid for dbus_message_demarshal, the
+    // message is copied without it afterwards
+    put(static_cast<uint32_t>(0));
+    put(static_cast<uint32_t>(1));
+    put(static_cast<uint32_t>(0));
+
+    // Every field is a (yv) struct, with the variant holding a single basic value
+    const auto field = [this](const uint8_t code, const char type, const char* value) -> void
+    {
+        if (value == nullptr)
+            return;
+        align(8);
+        wire.push_back(code);
+        wire.push_back(1);
+        wire.push_back(static_cast<uint8_t>(type));
+        wire.push_back('\0');
+        if (type == DBUS_TYPE_SIGNATURE)
+        {
+            const size_t length = strlen(value);
+            wire.push_back(static_cast<uint8_t>(length));
+            wire.insert(wire.end(), value, value + length + 1);
+        }
+        else
+            putString(value);
+    };
+
+    field(DBUS_HEADER_FIELD_PATH, DBUS_TYPE_OBJECT_PATH, dbus_message_get_path(message));
+    field(DBUS_HEADER_FIELD_INTERFACE, DBUS_TYPE_STRING, dbus_message_get_interface(message));
+    field(DBUS_HEADER_FIELD_MEMBER, DBUS_TYPE_STRING, dbus_message_get_member(message));
+    field(DBUS_HEADER_FIELD_ERROR_NAME, DBUS_TYPE_STRING, dbus_message_get_error_name(message));
+    field(DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING, dbus_message_get_destination(message));
+    field(DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING, dbus_message_get_sender(message));
+    if (!signature.empty())
+        field(DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE, signature.c_str());
+
+    const dbus_uint32_t replySerial = dbus_message_get_reply_serial(message);
+    if (replySerial != 0)
+    {
+        align(8);
+        wire.insert(wire.end(), { DBUS_HEADER_FIELD_REPLY_SERIAL, 1, DBUS_TYPE_UINT32, '\0' });
+        put(replySerial);
+    }
+
+    const auto fieldsLength = static_cast<uint32_t>(wire.size() - UDBUS_WIRE_FIXED_HEADER_SIZE);
+    memcpy(wire.data() + UDBUS_WIRE_FIXED_HEADER_SIZE - sizeof(uint32_t), &fieldsLength, sizeof(fieldsLength));
+
+    // The body starts 8 byte aligned, so aligning the offsets in the buffer is the same as aligning them in the body
+    align(8);
+    bodyStart = wire.size();
+    return true;
+}
+
+bool UDBus::NativeMarshaller::endMessage(Message& message, Error& error) noexcept
+{
+    const auto bodyLength = static_cast<uint32_t>(wire.size() - bodyStart);
+    memcpy(wire.data() + 4, &bodyLength, sizeof(bodyLength));
+
+    DBusMessage* result = dbus_message_demarshal(reinterpret_cast<const char*>(wire.data()), static_cast<int>(wire.size()), error);
+    if (result == nullptr)
+        return false;
+
+    // The copy drops the serial and the lock of the demarshalled message, so it can be sent like any other message
+    DBusMessage* copy = dbus_message_copy(result);
+    dbus_message_unref(result);
+    if (copy == nullptr)
+    {
+        error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to copy the message");
+        return false;
+    }
+
+    message.unref();
+    UDBUS_GET_MESSAGE(message) = copy;
+    return true;
+}
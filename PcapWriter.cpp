@@ -0,0 +1,197 @@
+#include "DBusUtilsStats.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+// Marks the pending calls whose connection has a pcap writer, holding a pointer to it
+static dbus_int32_t pendingSlot = -1;
+
+// LINKTYPE_DBUS, every packet is one marshalled message
+#define UDBUS_PCAP_LINKTYPE_DBUS 231
+// The snapshot length used by dbus-monitor, the maximum length of a message
+#define UDBUS_PCAP_SNAPLEN 134217728
+
+struct PcapHeader
+{
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs;
+    uint32_t snapLen;
+    uint32_t network;
+};
+
+struct PcapRecordHeader
+{
+    uint32_t seconds;
+    uint32_t microseconds;
+    uint32_t includedLength;
+    uint32_t originalLength;
+};
+
+UDBus::PcapWriter::PcapWriter(const size_t capacity) noexcept
+{
+    this->capacity = capacity == 0 ? 1 : capacity;
+    queue.reserve(this->capacity);
+
+    // Allocating a slot that is already allocated only increases its reference count, which is released in the
+    // destructor
+    dbus_pending_call_allocate_data_slot(&pendingSlot);
+}
+
+bool UDBus::PcapWriter::open(const char* path, Error& error) noexcept
+{
+    close();
+
+    file = fopen(path, "wbe");
+    if (file == nullptr)
+    {
+        error.set(DBUS_ERROR_FAILED, strerror(errno));
+        return false;
+    }
+    // Large writes, so that the writer thread rarely has to wait for the disk
+    setvbuf(file, nullptr, _IOFBF, 1024 * 1024);
+
+    // Written in host byte order, which readers detect from the magic
+    const PcapHeader header{
+        .magic = 0xa1b2c3d4,
+        .versionMajor = 2,
+        .versionMinor = 4,
+        .thisZone = 0,
+        .sigFigs = 0,
+        .snapLen = UDBUS_PCAP_SNAPLEN,
+        .network = UDBUS_PCAP_LINKTYPE_DBUS,
+    };
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        error.set(DBUS_ERROR_FAILED, strerror(errno));
+        fclose(file);
+        file = nullptr;
+        return false;
+    }
+
+    bRunning = true;
+    writer = std::thread(&PcapWriter::run, this);
+    return true;
+}
+
+void UDBus::PcapWriter::close() noexcept
+{
+    if (writer.joinable())
+    {
+        {
+            std::lock_guard lock(mutex);
+            bRunning = false;
+        }
+        condition.notify_one();
+        writer.join();
+    }
+    if (file != nullptr)
+        fclose(file);
+    file = nullptr;
+}
+
+void UDBus::PcapWriter::capture(const Message& message) noexcept
+{
+    if (!message.is_valid())
+        return;
+
+    Capture capture{ .message = message };
+    clock_gettime(CLOCK_REALTIME, &capture.timestamp);
+    // Marshalling a message locks it first, which is a write, so it is done here rather than racing with the owner of
+    // the message on the writer thread. Sent messages are already locked
+    dbus_message_lock(capture.message);
+
+    bool bQueued = false;
+    bool bWake = false;
+    {
+        std::lock_guard lock(mutex);
+        if (bRunning && queue.size() < capacity)
+        {
+            dbus_message_ref(capture.message);
+            queue.push_back(capture);
+            bQueued = true;
+            // The writer wakes up on its own every few milliseconds, it is only woken early when the queue fills up
+            bWake = queue.size() == std::max<size_t>(capacity / 2, 1);
+        }
+    }
+
+    if (!bQueued)
+        droppedMessages.fetch_add(1, std::memory_order_relaxed);
+    else if (bWake)
+        condition.notify_one();
+}
+
+void UDBus::PcapWriter::track(DBusPendingCall* pending) noexcept
+{
+    if (pending != nullptr)
+        dbus_pending_call_set_data(pending, pendingSlot, this, nullptr);
+}
+
+void UDBus::PcapWriter::complete(DBusPendingCall* pending, const Message& reply) noexcept
+{
+    if (pendingSlot < 0 || pending == nullptr)
+        return;
+
+    auto* writer = static_cast<PcapWriter*>(dbus_pending_call_get_data(pending, pendingSlot));
+    if (writer != nullptr)
+        writer->capture(reply);
+}
+
+void UDBus::PcapWriter::run() noexcept
+{
+    std::vector<Capture> batch;
+    batch.reserve(capacity);
+    bool bStopping = false;
+    while (!bStopping)
+    {
+        {
+            std::unique_lock lock(mutex);
+            condition.wait_for(lock, std::chrono::milliseconds(10), [this]() -> bool { return !bRunning || queue.size() >= std::max<size_t>(capacity / 2, 1); });
+            bStopping = !bRunning;
+            batch.swap(queue);
+        }
+
+        for (auto& a : batch)
+        {
+            char* data = nullptr;
+            int length = 0;
+            if (dbus_message_marshal(a.message, &data, &length))
+            {
+                const PcapRecordHeader header{
+                    .seconds = static_cast<uint32_t>(a.timestamp.tv_sec),
+                    .microseconds = static_cast<uint32_t>(a.timestamp.tv_nsec / 1000),
+                    .includedLength = static_cast<uint32_t>(length),
+                    .originalLength = static_cast<uint32_t>(length),
+                };
+                const bool bWritten = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                                      fwrite(data, 1, static_cast<size_t>(length), file) == static_cast<size_t>(length);
+                dbus_free(data);
+                (bWritten ? writtenMessages : droppedMessages).fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+                droppedMessages.fetch_add(1, std::memory_order_relaxed);
+            dbus_message_unref(a.message);
+        }
+        batch.clear();
+    }
+    fflush(file);
+}
+
+uint64_t UDBus::PcapWriter::written() const noexcept
+{
+    return writtenMessages.load(std::memory_order_relaxed);
+}
+
+uint64_t UDBus::PcapWriter::dropped() const noexcept
+{
+    return droppedMessages.load(std::memory_order_relaxed);
+}
+
+UDBus::PcapWriter::~PcapWriter() noexcept
+{
+    close();
+    dbus_pending_call_free_data_slot(&pendingSlot);
+}
@@ -0,0 +1,241 @@
+#include "DBusUtilsStats.hpp"
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Indexed by MessageGetResult
+static const char* decodeResultNames[] = {
+    "success",
+    "not_called",
+    "more_fields_than_required",
+    "less_fields_than_required",
+    "invalid_basic_type",
+    "invalid_struct_type",
+    "invalid_array_type",
+    "invalid_dictionary_type",
+    "invalid_dictionary_key",
+    "invalid_variant_type",
+    "invalid_variant_parsing",
+};
+
+// Appends to a fixed buffer like snprintf, but keeps counting the full length once the buffer is full
+struct Writer
+{
+    char* buffer = nullptr;
+    size_t size = 0;
+    size_t length = 0;
+
+    void write(const char* format, ...) noexcept __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        const size_t left = length < size ? size - length : 0;
+        const int written = vsnprintf(left > 0 ? buffer + length : nullptr, left, format, args);
+        va_end(args);
+        if (written > 0)
+            length += static_cast<size_t>(written);
+    }
+};
+
+// Label values may not contain raw backslashes, double quotes or newlines in the text exposition format
+static std::string escapeLabel(const char* value) noexcept
+{
+    std::string result;
+    for (; *value != '\0'; value++)
+    {
+        if (*value == '\\')
+            result += "\\\\";
+        else if (*value == '"')
+            result += "\\\"";
+        else if (*value == '\n')
+            result += "\\n";
+        else
+            result += *value;
+    }
+    return result;
+}
+
+void UDBus::PrometheusExporter::add(const char* name, const Connection& connection, const ConnectionStats& stats) noexcept
+{
+    targets.push_back({
+        .name = escapeLabel(name),
+        .connection = &connection,
+        .stats = &stats,
+    });
+}
+
+size_t UDBus::PrometheusExporter::render(char* buffer, const size_t size) const noexcept
+{
+    Writer writer{ .buffer = buffer, .size = size };
+    if (size > 0)
+        buffer[0] = '\0';
+
+    const auto counter = [&](const char* metric, const char* help, const char* type, uint64_t (*get)(const Target&)) -> void
+    {
+        writer.write("# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+        for (const auto& a : targets)
+            writer.write("%s{connection=\"%s\"} %llu\n", metric, a.name.c_str(), static_cast<unsigned long long>(get(a)));
+    };
+
+    counter("udbus_messages_sent_total", "Messages sent on the connection.", "counter",
+            [](const Target& t) -> uint64_t { return t.stats->messages_sent(); });
+    counter("udbus_messages_received_total", "Messages received on the connection.", "counter",
+            [](const Target& t) -> uint64_t { return t.stats->messages_received(); });
+    counter("udbus_bytes_sent_total", "Marshalled bytes sent on the connection, 0 unless the stats count bytes.", "counter",
+            [](const Target& t) -> uint64_t { return t.stats->bytes_sent(); });
+    counter("udbus_bytes_received_total", "Marshalled bytes received on the connection, 0 unless the stats count bytes.", "counter",
+            [](const Target& t) -> uint64_t { return t.stats->bytes_received(); });
+    counter("udbus_pending_calls", "Method calls waiting for a reply.", "gauge",
+            [](const Target& t) -> uint64_t { return t.stats->pending_calls(); });
+    counter("udbus_outgoing_queue_bytes", "Bytes queued for sending but not yet written to the socket.", "gauge",
+            [](const Target& t) -> uint64_t { return static_cast<uint64_t>(dbus_connection_get_outgoing_size(*t.connection)); });
+    counter("udbus_outgoing_queue_unix_fds", "Unix fds queued for sending but not yet written to the socket.", "gauge",
+            [](const Target& t) -> uint64_t { return static_cast<uint64_t>(dbus_connection_get_outgoing_unix_fds(*t.connection)); });
+    counter("udbus_dispatch_pending", "1 if received messages are waiting to be dispatched.", "gauge",
+            [](const Target& t) -> uint64_t { return dbus_connection_get_dispatch_status(*t.connection) == DBUS_DISPATCH_DATA_REMAINS; });
+    counter("udbus_connected", "1 if the connection is open.", "gauge",
+            [](const Target& t) -> uint64_t { return dbus_connection_get_is_connected(*t.connection); });
+
+    writer.write("# HELP udbus_decode_errors_total Failed Message::handleMessage calls in the process, by result.\n"
+                 "# TYPE udbus_decode_errors_total counter\n");
+    for (int i = RESULT_NOT_CALLED; i <= RESULT_INVALID_VARIANT_PARSING; i++)
+        writer.write("udbus_decode_errors_total{result=\"%s\"} %llu\n", decodeResultNames[i], static_cast<unsigned long long>(getDecodeErrors(static_cast<MessageGetResult>(i))));
+
+    return writer.length;
+}
+
+void UDBus::PrometheusExporter::serve(const char* address, Error& error) noexcept
+{
+    stop();
+
+    DBusAddressEntry** entries = nullptr;
+    int count = 0;
+    if (!dbus_parse_address(address, &entries, &count, error))
+        return;
+
+    const char* method = dbus_address_entry_get_method(entries[0]);
+    if (strcmp(method, "unix") == 0)
+    {
+        const char* path = dbus_address_entry_get_value(entries[0], "path");
+        sockaddr_un addr{};
+        if (path == nullptr || strlen(path) >= sizeof(addr.sun_path))
+            error.set(DBUS_ERROR_BAD_ADDRESS, "Unix addresses need a path that fits in sockaddr_un");
+        else
+        {
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, path);
+            // Remove the socket of a previous run
+            unlink(path);
+            listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0)
+                error.set(DBUS_ERROR_FAILED, strerror(errno));
+            else
+                socketPath = path;
+        }
+    }
+    else if (strcmp(method, "tcp") == 0)
+    {
+        const char* host = dbus_address_entry_get_value(entries[0], "host");
+        const char* port = dbus_address_entry_get_value(entries[0], "port");
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* info = nullptr;
+        if (port == nullptr || getaddrinfo(host == nullptr ? "127.0.0.1" : host, port, &hints, &info) != 0)
+            error.set(DBUS_ERROR_BAD_ADDRESS, "Couldn't resolve the tcp address");
+        else
+        {
+            listener = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            const int reuse = 1;
+            if (listener >= 0)
+                setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (listener < 0 || bind(listener, info->ai_addr, info->ai_addrlen) != 0 || listen(listener, 16) != 0)
+                error.set(DBUS_ERROR_FAILED, strerror(errno));
+            freeaddrinfo(info);
+        }
+    }
+    else
+        error.set(DBUS_ERROR_BAD_ADDRESS, "Only unix and tcp addresses are supported");
+    dbus_address_entries_free(entries);
+
+    if (error.is_set())
+    {
+        if (listener >= 0)
+            close(listener);
+        listener = -1;
+        return;
+    }
+
+    // The connections are read from the server thread
+    dbus_threads_init_default();
+    bRunning = true;
+    server = std::thread(&PrometheusExporter::run, this);
+}
+
+void UDBus::PrometheusExporter::run() noexcept
+{
+    std::vector<char> body(16384);
+    while (bRunning)
+    {
+        // Wake up regularly to notice stop
+        pollfd fd{ .fd = listener, .events = POLLIN, .revents = 0 };
+        if (poll(&fd, 1, 100) <= 0)
+            continue;
+
+        const int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+
+        // Read the request, its contents do not matter as every path returns the metrics
+        char request[4096];
+        pollfd clientFD{ .fd = client, .events = POLLIN, .revents = 0 };
+        if (poll(&clientFD, 1, 1000) > 0)
+            (void)read(client, request, sizeof(request));
+
+        size_t length = render(body.data(), body.size());
+        if (length >= body.size())
+        {
+            body.resize(length + 1);
+            length = render(body.data(), body.size());
+        }
+
+        char header[128];
+        const int headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+        // MSG_NOSIGNAL, so that a scraper that hangs up early does not kill the process with SIGPIPE
+        bool bOk = send(client, header, headerLength, MSG_NOSIGNAL) == headerLength;
+        for (size_t written = 0; bOk && written < length;)
+        {
+            const auto result = send(client, body.data() + written, length - written, MSG_NOSIGNAL);
+            bOk = result > 0;
+            written += bOk ? static_cast<size_t>(result) : 0;
+        }
+        close(client);
+    }
+}
+
+void UDBus::PrometheusExporter::stop() noexcept
+{
+    if (server.joinable())
+    {
+        bRunning = false;
+        server.join();
+    }
+    if (listener >= 0)
+        close(listener);
+    listener = -1;
+    if (!socketPath.empty())
+        unlink(socketPath.c_str());
+    socketPath.clear();
+}
+
+UDBus::PrometheusExporter::~PrometheusExporter() noexcept
+{
+    stop();
+}
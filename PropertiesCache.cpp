@@ -0,0 +1,241 @@
+#include "DBusUtilsSignals.hpp"
+
+#define UDBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+bool UDBus::PropertiesCache::populate(const Connection& connection, const char* destination, const char* path, const char* interface, Error& error) noexcept
+{
+    clear();
+    this->connection = &connection;
+    this->destination = destination;
+    this->path = path;
+    this->interface = interface;
+
+    // The bus sends signals with the unique name of the sender, so resolve the owner of well-known names and follow it
+    owners = std::make_unique<NameOwnerCache>(connection);
+    owners->set_handler([this](const char*, const char*, const char* newOwner) { onOwnerChanged(newOwner); });
+    if (!owners->track(destination, error))
+    {
+        owners.reset();
+        return false;
+    }
+
+    const char* resolved = owners->get_owner(destination);
+    if (resolved == nullptr)
+    {
+        error.set(DBUS_ERROR_NAME_HAS_NO_OWNER, "The destination has no owner");
+        return false;
+    }
+    owner = resolved;
+
+    // Subscribe before fetching, so that no change is lost between the GetAll reply and the first signal
+    baseRule = std::string("type='signal',interface='" UDBUS_PROPERTIES_INTERFACE "',member='PropertiesChanged',path='") + path + "',arg0='" + interface + "'";
+    rule = baseRule + ",sender='" + owner + "'";
+    dbus_bus_add_match(connection, rule.c_str(), error);
+    if (error.is_set())
+    {
+        rule.clear();
+        return false;
+    }
+
+    Message message;
+    message.new_method_call(owner.c_str(), path, UDBUS_PROPERTIES_INTERFACE, "GetAll");
+    if (!message.is_valid() || !dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID))
+    {
+        error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to create the GetAll call");
+        return false;
+    }
+
+    const auto reply = connection.send_with_reply_and_block(message, DBUS_TIMEOUT_USE_DEFAULT, error);
+    if (!reply.is_valid() || error.is_set())
+        return false;
+
+    DBusMessageIter it;
+    if (!dbus_message_iter_init(reply, &it) || !storeAll(&it))
+    {
+        error.set(DBUS_ERROR_INVALID_SIGNATURE, "GetAll did not return an a{sv}");
+        return false;
+    }
+    return true;
+}
+
+bool UDBus::PropertiesCache::store(const char* name, DBusMessageIter* value) noexcept
+{
+    Property property;
+    property.value.new_1(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+    if (!property.value.is_valid())
+        return false;
+
+    DBusMessageIter append;
+    dbus_message_iter_init_append(property.value, &append);
+    if (!Iterator::copy(value, &append))
+        return false;
+
+    property.type = dbus_message_iter_get_arg_type(value);
+    if (dbus_type_is_basic(property.type))
+    {
+        // Read the value back from our own message, so that strings point into memory owned by the property
+        DBusMessageIter it;
+        dbus_message_iter_init(property.value, &it);
+        dbus_message_iter_get_basic(&it, &property.basic);
+    }
+
+    if (const auto it = properties.find(name); it != properties.end())
+        it->second = std::move(property);
+    else
+        properties.emplace(name, std::move(property));
+    return true;
+}
+
+bool UDBus::PropertiesCache::storeAll(DBusMessageIter* dict) noexcept
+{
+    if (dbus_message_iter_get_arg_type(dict) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type(dict) != DBUS_TYPE_DICT_ENTRY)
+        return false;
+
+    DBusMessageIter entries;
+    dbus_message_iter_recurse(dict, &entries);
+    for (; dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&entries))
+    {
+        DBusMessageIter entry;
+        DBusMessageIter variant;
+        const char* name = nullptr;
+
+        dbus_message_iter_recurse(&entries, &entry);
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            return false;
+        dbus_message_iter_get_basic(&entry, &name);
+
+        dbus_message_iter_next(&entry);
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+            return false;
+        dbus_message_iter_recurse(&entry, &variant);
+        if (!store(name, &variant))
+            return false;
+    }
+    return true;
+}
+
+void UDBus::PropertiesCache::onOwnerChanged(const char* newOwner) noexcept
+{
+    // The values belong to the old owner. Without a reply to wait for, the new rule may miss changes made before the
+    // bus registers it, but the properties are fetched again on their next read anyway
+    if (!rule.empty())
+        dbus_bus_remove_match(*connection, rule.c_str(), nullptr);
+    rule.clear();
+    properties.clear();
+    missing.clear();
+
+    owner = newOwner;
+    if (owner.empty())
+        return;
+    rule = baseRule + ",sender='" + owner + "'";
+    dbus_bus_add_match(*connection, rule.c_str(), nullptr);
+}
+
+bool UDBus::PropertiesCache::handleSignal(const Message& signal) noexcept
+{
+    if (owners != nullptr && owners->handleSignal(signal))
+        return true;
+
+    if (rule.empty() || !signal.is_signal(UDBUS_PROPERTIES_INTERFACE, "PropertiesChanged"))
+        return false;
+
+    const char* sender = dbus_message_get_sender(signal);
+    if (sender == nullptr || owner != sender)
+        return false;
+
+    const char* signalPath = dbus_message_get_path(signal);
+    if (signalPath == nullptr || path != signalPath)
+        return false;
+
+    const char* signalInterface = nullptr;
+    DBusMessageIter it;
+    if (!dbus_message_iter_init(signal, &it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_STRING)
+        return false;
+    dbus_message_iter_get_basic(&it, &signalInterface);
+    if (interface != signalInterface)
+        return false;
+
+    // The object changed, so properties that did not exist before may exist now
+    missing.clear();
+
+    // Changed properties
+    if (!dbus_message_iter_next(&it))
+        return true;
+    storeAll(&it);
+
+    // Invalidated properties are dropped, and fetched again on their next read
+    if (!dbus_message_iter_next(&it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_ARRAY)
+        return true;
+
+    DBusMessageIter invalidated;
+    dbus_message_iter_recurse(&it, &invalidated);
+    for (; dbus_message_iter_get_arg_type(&invalidated) == DBUS_TYPE_STRING; dbus_message_iter_next(&invalidated))
+    {
+        const char* name = nullptr;
+        dbus_message_iter_get_basic(&invalidated, &name);
+        if (const auto property = properties.find(name); property != properties.end())
+            properties.erase(property);
+    }
+    return true;
+}
+
+UDBus::PropertiesCache::Property* UDBus::PropertiesCache::find(const char* name) noexcept
+{
+    if (const auto it = properties.find(std::string_view(name)); it != properties.end())
+        return &it->second;
+
+    // Cache miss. The property was either invalidated or never existed, so ask the peer for it
+    if (connection == nullptr || owner.empty() || missing.contains(std::string_view(name)))
+        return nullptr;
+
+    Message message;
+    message.new_method_call(owner.c_str(), path.c_str(), UDBUS_PROPERTIES_INTERFACE, "Get");
+    const char* iface = interface.c_str();
+    if (!message.is_valid() || !dbus_message_append_args(message, DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID))
+        return nullptr;
+
+    Error error;
+    const auto reply = connection->send_with_reply_and_block(message, DBUS_TIMEOUT_USE_DEFAULT, error);
+    DBusMessageIter it;
+    DBusMessageIter variant;
+    if (!reply.is_valid() || error.is_set() || !dbus_message_iter_init(reply, &it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_VARIANT)
+    {
+        // Only remember answers of the peer, not failures to reach it
+        if (!error.has_name(DBUS_ERROR_NO_REPLY) && !error.has_name(DBUS_ERROR_TIMEOUT) && !error.has_name(DBUS_ERROR_DISCONNECTED) &&
+            !error.has_name(DBUS_ERROR_NO_MEMORY))
+            missing.emplace(name);
+        return nullptr;
+    }
+
+    dbus_message_iter_recurse(&it, &variant);
+    if (!store(name, &variant))
+        return nullptr;
+    return &properties.find(std::string_view(name))->second;
+}
+
+bool UDBus::PropertiesCache::contains(const char* name) const noexcept
+{
+    return properties.contains(std::string_view(name));
+}
+
+size_t UDBus::PropertiesCache::size() const noexcept
+{
+    return properties.size();
+}
+
+void UDBus::PropertiesCache::clear() noexcept
+{
+    if (connection != nullptr && !rule.empty())
+        dbus_bus_remove_match(*connection, rule.c_str(), nullptr);
+    rule.clear();
+    owners.reset();
+    owner.clear();
+    connection = nullptr;
+    properties.clear();
+    missing.clear();
+}
+
+UDBus::PropertiesCache::~PropertiesCache() noexcept
+{
+    clear();
+}
@@ -0,0 +1,313 @@
+#include "DBusUtilsStats.hpp"
+#include <cerrno>
+#include <cstring>
+
+#define UDBUS_REPLAY_MAGIC "UDBUSRPL"
+#define UDBUS_PCAP_LINKTYPE_DBUS 231
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+    struct ReplayState;
+
+    // A place in the window of calls in flight. Its address is the user data of the pending call notification, so
+    // slots never move during a run
+    struct Slot
+    {
+        UDBus::PendingCall call{};
+        Clock::time_point sent{};
+        ReplayState* state = nullptr;
+        size_t index = 0;
+    };
+
+    struct ReplayState
+    {
+        UDBus::ReplayResult* result = nullptr;
+        std::vector<Slot> slots{};
+        std::vector<size_t> free{};
+    };
+}
+
+static uint32_t byteSwap(const uint32_t value, const bool bSwap) noexcept
+{
+    return bSwap ? __builtin_bswap32(value) : value;
+}
+
+static bool readFile(const char* path, std::vector<char>& data, UDBus::Error& error) noexcept
+{
+    FILE* file = fopen(path, "rbe");
+    if (file == nullptr)
+    {
+        error.set(DBUS_ERROR_FILE_NOT_FOUND, strerror(errno));
+        return false;
+    }
+
+    char buffer[65536];
+    size_t length = 0;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + length);
+    const bool bFailed = ferror(file) != 0;
+    fclose(file);
+    if (bFailed)
+        error.set(DBUS_ERROR_IO_ERROR, "Couldn't read the capture file");
+    return !bFailed;
+}
+
+static void onReply(DBusPendingCall* pending, void* data) noexcept
+{
+    auto& slot = *static_cast<Slot*>(data);
+    auto& result = *slot.state->result;
+    const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - slot.sent);
+
+    UDBus::Message reply;
+    reply.pending_call_steal_reply(pending);
+    result.replies++;
+    result.latency.record(static_cast<uint64_t>(latency.count()));
+    // Timeouts and disconnections complete the call with an error reply made by libdbus
+    if (!reply.is_valid() || reply.get_type() == DBUS_MESSAGE_TYPE_ERROR)
+        result.errors++;
+
+    slot.call.unref();
+    slot.state->free.push_back(slot.index);
+}
+
+bool UDBus::Replay::add(const char* data, const size_t length, const uint64_t timestamp, Error& error) noexcept
+{
+    auto& entry = entries.emplace_back();
+    entry.timestamp = timestamp;
+    entry.message.demarshal(data, static_cast<int>(length), error);
+    if (!entry.message.is_valid())
+    {
+        entries.pop_back();
+        if (!error.is_set())
+            error.set(DBUS_ERROR_INVALID_ARGS, "Couldn't demarshal a captured message");
+        return false;
+    }
+    return true;
+}
+
+bool UDBus::Replay::load(const char* path, Error& error) noexcept
+{
+    entries.clear();
+    std::vector<char> data;
+    if (!readFile(path, data, error))
+        return false;
+
+    if (data.size() >= 8 && memcmp(data.data(), UDBUS_REPLAY_MAGIC, 8) == 0)
+    {
+        for (size_t offset = 8; offset < data.size();)
+        {
+            uint64_t timestamp = 0;
+            uint32_t length = 0;
+            if (data.size() - offset < sizeof(timestamp) + sizeof(length))
+                break;
+            memcpy(&timestamp, data.data() + offset, sizeof(timestamp));
+            memcpy(&length, data.data() + offset + sizeof(timestamp), sizeof(length));
+            offset += sizeof(timestamp) + sizeof(length);
+            if (data.size() - offset < length)
+                break;
+            if (!add(data.data() + offset, length, timestamp, error))
+                return false;
+            offset += length;
+        }
+        return true;
+    }
+
+    uint32_t magic = 0;
+    if (data.size() >= 24)
+        memcpy(&magic, data.data(), sizeof(magic));
+
+    // The magic tells both the byte order of the writer and whether timestamps are in micro or nanoseconds
+    const bool bSwap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    const bool bNanoseconds = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    if (!bSwap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+    {
+        error.set(DBUS_ERROR_INVALID_FILE_CONTENT, "Not a pcap or compact replay file");
+        return false;
+    }
+
+    uint32_t network = 0;
+    memcpy(&network, data.data() + 20, sizeof(network));
+    if (byteSwap(network, bSwap) != UDBUS_PCAP_LINKTYPE_DBUS)
+    {
+        error.set(DBUS_ERROR_INVALID_FILE_CONTENT, "The pcap file does not use the D-Bus link type");
+        return false;
+    }
+
+    for (size_t offset = 24; data.size() - offset >= 16;)
+    {
+        uint32_t header[4];
+        memcpy(header, data.data() + offset, sizeof(header));
+        const uint32_t included = byteSwap(header[2], bSwap);
+        const uint32_t original = byteSwap(header[3], bSwap);
+        offset += sizeof(header);
+        if (data.size() - offset < included)
+            break;
+
+        const uint64_t fraction = byteSwap(header[1], bSwap);
+        const uint64_t timestamp = byteSwap(header[0], bSwap) * 1000000000ull + (bNanoseconds ? fraction : fraction * 1000);
+        // Packets cut by the snapshot length cannot be demarshalled, so they are left out
+        if (included == original && !add(data.data() + offset, included, timestamp, error))
+            return false;
+        offset += included;
+    }
+    return true;
+}
+
+bool UDBus::Replay::save(const char* path, Error& error) const noexcept
+{
+    FILE* file = fopen(path, "wbe");
+    if (file == nullptr)
+    {
+        error.set(DBUS_ERROR_FAILED, strerror(errno));
+        return false;
+    }
+
+    bool bOk = fwrite(UDBUS_REPLAY_MAGIC, 1, 8, file) == 8;
+    for (size_t i = 0; bOk && i < entries.size(); i++)
+    {
+        char* data = nullptr;
+        int length = 0;
+        if (!entries[i].message.marshal(&data, &length))
+        {
+            bOk = false;
+            break;
+        }
+        const auto size = static_cast<uint32_t>(length);
+        bOk = fwrite(&entries[i].timestamp, sizeof(entries[i].timestamp), 1, file) == 1 && fwrite(&size, sizeof(size), 1, file) == 1 &&
+              fwrite(data, 1, size, file) == size;
+        dbus_free(data);
+    }
+
+    if (fclose(file) != 0)
+        bOk = false;
+    if (!bOk)
+        error.set(DBUS_ERROR_FAILED, "Couldn't write the replay file");
+    return bOk;
+}
+
+size_t UDBus::Replay::size() const noexcept
+{
+    return entries.size();
+}
+
+bool UDBus::Replay::run(const Connection& connection, const ReplayOptions& options, ReplayResult& result, Error& error) const noexcept
+{
+    ReplayState state;
+    state.result = &result;
+    state.slots = std::vector<Slot>(options.window == 0 ? 1 : options.window);
+    for (size_t i = 0; i < state.slots.size(); i++)
+    {
+        state.slots[i].state = &state;
+        state.slots[i].index = i;
+        state.free.push_back(state.slots.size() - 1 - i);
+    }
+
+    // Writes out what was sent and completes the calls whose replies arrived. read_write_dispatch only dispatches a
+    // single message, so the rest of the queue is dispatched here
+    const auto pump = [&](const int timeout) -> bool
+    {
+        if (!connection.read_write_dispatch(timeout))
+            return false;
+        while (dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)
+            dbus_connection_dispatch(connection);
+        return true;
+    };
+
+    bool bConnected = true;
+    const auto start = Clock::now();
+    uint64_t firstTimestamp = 0;
+    bool bFirst = true;
+    for (const auto& entry : entries)
+    {
+        const int type = entry.message.get_type();
+        if (type != DBUS_MESSAGE_TYPE_METHOD_CALL && type != DBUS_MESSAGE_TYPE_SIGNAL)
+        {
+            result.skipped++;
+            continue;
+        }
+        // Replaying messages that were received would impersonate their senders, and send our own calls back to us
+        const char* sender = dbus_message_get_sender(entry.message);
+        if (options.sender == nullptr ? sender != nullptr : sender == nullptr || strcmp(sender, options.sender) != 0)
+        {
+            result.skipped++;
+            continue;
+        }
+        // The connection already said hello, the bus refuses a second one
+        if (type == DBUS_MESSAGE_TYPE_METHOD_CALL && dbus_message_is_method_call(entry.message, DBUS_INTERFACE_DBUS, "Hello"))
+        {
+            result.skipped++;
+            continue;
+        }
+
+        if (bFirst)
+            firstTimestamp = entry.timestamp;
+        bFirst = false;
+
+        if (options.timing != REPLAY_AS_FAST_AS_POSSIBLE)
+        {
+            // Captures of multi-threaded writers are not always in timestamp order, messages from before the first
+            // one are due right away
+            const uint64_t elapsed = entry.timestamp > firstTimestamp ? entry.timestamp - firstTimestamp : 0;
+            const double offset = options.timing == REPLAY_ORIGINAL ?
+                static_cast<double>(elapsed) / (options.speed > 0 ? options.speed : 1.0) :
+                static_cast<double>(result.sent + result.errors) * 1e9 / (options.rate > 0 ? options.rate : 1.0);
+            const auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(offset));
+            // Sleeps in whole milliseconds, then keeps polling without blocking for the rest
+            for (auto now = Clock::now(); bConnected && now < due; now = Clock::now())
+                bConnected = pump(static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count()));
+        }
+        while (bConnected && state.free.empty())
+            bConnected = pump(100);
+        if (!bConnected)
+            break;
+
+        // The copy has no serial and is not locked, so it can be sent again and redirected
+        Message message(dbus_message_copy(entry.message));
+        if (!message.is_valid() || (options.destination != nullptr && !dbus_message_set_destination(message, options.destination)))
+        {
+            result.errors++;
+            continue;
+        }
+
+        if (type == DBUS_MESSAGE_TYPE_METHOD_CALL && !dbus_message_get_no_reply(message))
+        {
+            auto& slot = state.slots[state.free.back()];
+            slot.sent = Clock::now();
+            if (!connection.send_with_reply(message, slot.call, options.timeoutMilliseconds) || static_cast<DBusPendingCall*>(slot.call) == nullptr ||
+                !slot.call.set_notify(onReply, &slot, nullptr))
+            {
+                slot.call.unref();
+                result.errors++;
+                continue;
+            }
+            state.free.pop_back();
+        }
+        else if (!connection.send(message, nullptr))
+        {
+            result.errors++;
+            continue;
+        }
+        result.sent++;
+        bConnected = pump(0);
+    }
+
+    while (bConnected && state.free.size() < state.slots.size())
+        bConnected = pump(100);
+    result.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+
+    // The notifications point into the slots, so calls that never completed must not outlive them
+    for (auto& a : state.slots)
+    {
+        if (static_cast<DBusPendingCall*>(a.call) == nullptr)
+            continue;
+        a.call.cancel();
+        a.call.unref();
+        result.errors++;
+    }
+
+    if (!bConnected)
+        error.set(DBUS_ERROR_DISCONNECTED, "The connection was closed during the replay");
+    return bConnected;
+}
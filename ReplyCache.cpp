@@ -0,0 +1,145 @@
+#include "DBusUtilsAsync.hpp"
+
+UDBus::ReplyCache::ReplyCache(const size_t maxBytes) noexcept
+{
+    this->maxBytes = maxBytes;
+}
+
+std::string UDBus::ReplyCache::methodName(const char* interface, const char* member) noexcept
+{
+    std::string result = interface == nullptr ? "" : interface;
+    result += '.';
+    if (member != nullptr)
+        result += member;
+    return result;
+}
+
+void UDBus::ReplyCache::set_ttl(const char* interface, const char* member, const std::chrono::milliseconds ttl) noexcept
+{
+    ttls[methodName(interface, member)] = ttl;
+}
+
+bool UDBus::ReplyCache::invalidate_on(const char* signal_interface, const char* signal_member, const char* interface, const char* member) noexcept
+{
+    if (signal_interface == nullptr || signal_member == nullptr)
+        return false;
+
+    rules.push_back(InvalidationRule{
+        .signalInterface = signal_interface,
+        .signalMember = signal_member,
+        .method = methodName(interface, member),
+    });
+    return true;
+}
+
+void UDBus::ReplyCache::erase(const std::list<Entry>::iterator it) noexcept
+{
+    currentBytes -= it->bytes;
+    lookup.erase(it->key);
+    entries.erase(it);
+}
+
+UDBus::Message UDBus::ReplyCache::send_with_reply_and_block(const Connection& connection, Message& message, const int timeout_milliseconds, Error& error) noexcept
+{
+    const auto ttl = ttls.find(methodName(dbus_message_get_interface(message), dbus_message_get_member(message)));
+    std::string key;
+    if (ttl == ttls.end() || !makeRequestKey(message, key))
+        return connection.send_with_reply_and_block(message, timeout_milliseconds, error);
+
+    const auto now = Clock::now();
+    if (const auto it = lookup.find(key); it != lookup.end())
+    {
+        if (it->second->expiry > now)
+        {
+            // Move the entry to the front of the LRU list
+            entries.splice(entries.begin(), entries, it->second);
+            Message reply;
+            reply.ref(entries.front().reply);
+            return reply;
+        }
+        erase(it->second);
+    }
+
+    auto reply = connection.send_with_reply_and_block(message, timeout_milliseconds, error);
+    if (!reply.is_valid() || error.is_set())
+        return reply;
+
+    // Account for the marshalled size of the reply, as that is roughly what libdbus keeps in memory for it
+    char* data = nullptr;
+    int len = 0;
+    if (!reply.marshal(&data, &len))
+        return reply;
+    dbus_free(data);
+
+    const size_t size = key.size() + static_cast<size_t>(len);
+    if (size > maxBytes)
+        return reply;
+    while (currentBytes + size > maxBytes && !entries.empty())
+        erase(std::prev(entries.end()));
+
+    const char* path = dbus_message_get_path(message);
+    auto& entry = entries.emplace_front(Entry{
+        .key = std::move(key),
+        .method = ttl->first,
+        .path = path == nullptr ? "" : path,
+        .reply = {},
+        .expiry = now + ttl->second,
+        .bytes = size,
+    });
+    entry.reply.ref(reply);
+    lookup.emplace(entry.key, entries.begin());
+    currentBytes += size;
+    return reply;
+}
+
+bool UDBus::ReplyCache::handleSignal(const Message& signal) noexcept
+{
+    const char* path = dbus_message_get_path(signal);
+    bool bInvalidated = false;
+    for (const auto& a : rules)
+    {
+        if (!signal.is_signal(a.signalInterface.c_str(), a.signalMember.c_str()))
+            continue;
+
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            const auto next = std::next(it);
+            if (it->method == a.method && path != nullptr && it->path == path)
+            {
+                erase(it);
+                bInvalidated = true;
+            }
+            it = next;
+        }
+    }
+    return bInvalidated;
+}
+
+void UDBus::ReplyCache::invalidate(const char* interface, const char* member) noexcept
+{
+    const auto method = methodName(interface, member);
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        const auto next = std::next(it);
+        if (it->method == method)
+            erase(it);
+        it = next;
+    }
+}
+
+void UDBus::ReplyCache::clear() noexcept
+{
+    entries.clear();
+    lookup.clear();
+    currentBytes = 0;
+}
+
+size_t UDBus::ReplyCache::size() const noexcept
+{
+    return entries.size();
+}
+
+size_t UDBus::ReplyCache::bytes() const noexcept
+{
+    return currentBytes;
+}
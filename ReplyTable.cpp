@@ -0,0 +1,188 @@
+#include "DBusUtilsAsync.hpp"
+#include "DBusUtilsStats.hpp"
+#include <bit>
+#include <climits>
+
+// libdbus uses a 25 second default timeout when DBUS_TIMEOUT_USE_DEFAULT is passed
+#define UDBUS_DEFAULT_TIMEOUT_MILLISECONDS 25000
+
+UDBus::ReplyTable::ReplyTable(const size_t capacity) noexcept
+{
+    slots.resize(std::bit_ceil(capacity < 8 ? 8 : capacity));
+}
+
+size_t UDBus::ReplyTable::home(const dbus_uint32_t serial) const noexcept
+{
+    // Serials are sequential, so Fibonacci hashing spreads them over the table instead of clustering them
+    return (serial * 2654435769u) & (slots.size() - 1);
+}
+
+size_t UDBus::ReplyTable::find(const dbus_uint32_t serial) const noexcept
+{
+    // 0 marks the empty slots, it would match the first one
+    if (serial == 0)
+        return SIZE_MAX;
+
+    for (size_t i = home(serial);; i = (i + 1) & (slots.size() - 1))
+    {
+        if (slots[i].serial == serial)
+            return i;
+        if (slots[i].serial == 0)
+            return SIZE_MAX;
+    }
+}
+
+void UDBus::ReplyTable::insert(Slot&& slot) noexcept
+{
+    // Keep the load factor under 1/2 so that probe sequences stay short
+    if ((count + 1) * 2 > slots.size())
+        grow();
+
+    size_t i = home(slot.serial);
+    while (slots[i].serial != 0)
+        i = (i + 1) & (slots.size() - 1);
+    slots[i] = std::move(slot);
+    count++;
+}
+
+UDBus::ReplyTable::Slot UDBus::ReplyTable::take(size_t index) noexcept
+{
+    Slot result = std::move(slots[index]);
+    slots[index] = Slot{};
+    count--;
+
+    // Backward shift deletion. Moves every following element of the cluster that is allowed to live in the freed slot
+    // into it, so no tombstones are needed and lookups never degrade
+    const size_t mask = slots.size() - 1;
+    for (size_t next = (index + 1) & mask; slots[next].serial != 0; next = (next + 1) & mask)
+    {
+        const size_t desired = home(slots[next].serial);
+        if (((next - desired) & mask) >= ((next - index) & mask))
+        {
+            slots[index] = std::move(slots[next]);
+            slots[next] = Slot{};
+            index = next;
+        }
+    }
+    return result;
+}
+
+void UDBus::ReplyTable::grow() noexcept
+{
+    auto old = std::move(slots);
+    slots = std::vector<Slot>(old.size() * 2);
+    count = 0;
+    for (auto& a : old)
+        if (a.serial != 0)
+            insert(std::move(a));
+}
+
+udbus_bool_t UDBus::ReplyTable::send(const Connection& connection, Message& message, ReplyContinuation continuation, const int timeout_milliseconds) noexcept
+{
+    const auto start = Clock::now();
+    dbus_uint32_t serial = 0;
+    if (!connection.send(message, &serial))
+        return false;
+
+    // Infinite calls never get a timer, so they can only complete with a reply or be cancelled
+    TimingWheel::Handle timer = 0;
+    if (timeout_milliseconds == DBUS_TIMEOUT_USE_DEFAULT)
+        timer = wheel.insert(Clock::now() + std::chrono::milliseconds(UDBUS_DEFAULT_TIMEOUT_MILLISECONDS), serial);
+    else if (timeout_milliseconds != DBUS_TIMEOUT_INFINITE)
+        timer = wheel.insert(Clock::now() + std::chrono::milliseconds(timeout_milliseconds), serial);
+
+    Slot slot{
+        .serial = serial,
+        .timer = timer,
+        .continuation = std::move(continuation),
+        .stats = connection.get_stats(),
+        .start = start,
+    };
+    if (slot.stats != nullptr)
+        slot.call.ref(message);
+    insert(std::move(slot));
+    return true;
+}
+
+bool UDBus::ReplyTable::route(Message& message) noexcept
+{
+    const auto type = message.get_type();
+    if (type != DBUS_MESSAGE_TYPE_METHOD_RETURN && type != DBUS_MESSAGE_TYPE_ERROR)
+        return false;
+
+    // Replies without a reply serial can not belong to any call
+    const dbus_uint32_t serial = dbus_message_get_reply_serial(message);
+    if (serial == 0)
+        return false;
+
+    const auto index = find(serial);
+    if (index == SIZE_MAX)
+        return false;
+
+    // Remove the call before running the continuation, so that it can freely send new tracked calls
+    auto slot = take(index);
+    if (slot.timer != 0)
+        wheel.cancel(slot.timer);
+    if (slot.stats != nullptr)
+        slot.stats->record(METHOD_STATS_CLIENT, slot.call, message, Clock::now() - slot.start);
+    Error error;
+    if (type == DBUS_MESSAGE_TYPE_ERROR)
+        dbus_set_error_from_message(error, message);
+    slot.continuation(message, error);
+    trace(TRACE_HANDLER_END, message);
+    return true;
+}
+
+UDBus::Message UDBus::ReplyTable::pop_message(const Connection& connection) noexcept
+{
+    auto message = connection.pop_message();
+    while (message.is_valid() && route(message))
+        message = connection.pop_message();
+    return message;
+}
+
+size_t UDBus::ReplyTable::expire() noexcept
+{
+    // Continuations run after the wheel has finished advancing, as they may send new calls and insert new timers
+    std::vector<Slot> expired;
+    wheel.advance(Clock::now(), [&](const std::vector<uint64_t>& serials) -> void
+    {
+        for (const auto& a : serials)
+        {
+            const auto index = find(static_cast<dbus_uint32_t>(a));
+            if (index != SIZE_MAX)
+                expired.push_back(take(index));
+        }
+    });
+
+    for (auto& a : expired)
+    {
+        Message reply;
+        if (a.stats != nullptr)
+            a.stats->record(METHOD_STATS_CLIENT, a.call, reply, Clock::now() - a.start);
+        Error error;
+        error.set(DBUS_ERROR_NO_REPLY, "Did not receive a reply before the timeout expired");
+        a.continuation(reply, error);
+    }
+    return expired.size();
+}
+
+bool UDBus::ReplyTable::cancel(const dbus_uint32_t serial) noexcept
+{
+    if (serial == 0)
+        return false;
+
+    const auto index = find(serial);
+    if (index == SIZE_MAX)
+        return false;
+
+    const auto slot = take(index);
+    if (slot.timer != 0)
+        wheel.cancel(slot.timer);
+    return true;
+}
+
+size_t UDBus::ReplyTable::size() const noexcept
+{
+    return count;
+}
@@ -0,0 +1,140 @@
+#include "DBusUtilsConcurrency.hpp"
+#include <bit>
+
+UDBus::SendQueue::SendQueue(const size_t capacity) noexcept
+{
+    const size_t size = std::bit_ceil(capacity < 2 ? 2 : capacity);
+    cells = std::make_unique<Cell[]>(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+void UDBus::SendQueue::start(const Connection& connection, const size_t batchSize) noexcept
+{
+    stop();
+    dbus_threads_init_default();
+    this->connection = &connection;
+    this->batchSize = batchSize == 0 ? 1 : batchSize;
+    bStopping.store(false);
+    writer = std::thread(&SendQueue::run, this);
+}
+
+void UDBus::SendQueue::stop() noexcept
+{
+    if (!writer.joinable())
+        return;
+
+    bStopping.store(true);
+    wakeups.fetch_add(1);
+    wakeups.notify_one();
+    writer.join();
+}
+
+bool UDBus::SendQueue::push(Message& message) noexcept
+{
+    // This is the bounded queue by Dmitry Vyukov. A cell is free for the producer that claims position pos when its
+    // sequence is pos, and it is ready for the writer once the producer sets its sequence to pos + 1
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false;
+        else
+            pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+
+    // Take ownership of the message reference
+    auto** ptr = message.getMessagePointer();
+    cell->message = *ptr;
+    *ptr = nullptr;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    // Only wake the writer up if it is about to sleep. The fence pairs with the one in run, so that either the writer
+    // sees the new message or this sees that the writer is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (bSleeping.load(std::memory_order_relaxed))
+    {
+        wakeups.fetch_add(1);
+        wakeups.notify_one();
+    }
+    return true;
+}
+
+DBusMessage* UDBus::SendQueue::pop() noexcept
+{
+    auto& cell = cells[dequeuePos & mask];
+    if (cell.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+        return nullptr;
+
+    auto* message = cell.message;
+    cell.message = nullptr;
+    // Hand the cell back to the producers for the next lap around the ring
+    cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+    dequeuePos++;
+    return message;
+}
+
+void UDBus::SendQueue::run() noexcept
+{
+    while (true)
+    {
+        size_t count = 0;
+        size_t sentCount = 0;
+        for (DBusMessage* message = nullptr; count < batchSize && (message = pop()) != nullptr; count++)
+        {
+            // Goes through Connection::send, so queued messages get the same backpressure, statistics, recording and
+            // tracing as every other outgoing message. The wrapper takes over the reference of the queue
+            Message owned(message);
+            if (connection->send(owned, nullptr))
+                sentCount++;
+        }
+
+        if (count > 0)
+        {
+            connection->flush();
+            sentMessages.fetch_add(sentCount, std::memory_order_relaxed);
+            sentBatches.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (bStopping.load())
+            return;
+
+        // Announce that we are going to sleep, then check for messages one last time before actually sleeping
+        const auto current = wakeups.load();
+        bSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (cells[dequeuePos & mask].sequence.load(std::memory_order_acquire) != dequeuePos + 1 && !bStopping.load())
+            wakeups.wait(current);
+        bSleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+size_t UDBus::SendQueue::sent() const noexcept
+{
+    return sentMessages.load(std::memory_order_relaxed);
+}
+
+size_t UDBus::SendQueue::batches() const noexcept
+{
+    return sentBatches.load(std::memory_order_relaxed);
+}
+
+UDBus::SendQueue::~SendQueue() noexcept
+{
+    stop();
+
+    // Release whatever was pushed after the writer stopped
+    for (auto* message = pop(); message != nullptr; message = pop())
+        dbus_message_unref(message);
+}
@@ -0,0 +1,181 @@
+#include "DBusUtils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <poll.h>
+
+UDBus::Server::~Server() noexcept
+{
+    unref();
+}
+
+UDBus::Server::Server(Server&& other) noexcept
+{
+    server = other.server;
+    state = std::move(other.state);
+    other.server = nullptr;
+}
+
+UDBus::Server& UDBus::Server::operator=(Server&& other) noexcept
+{
+    if (this != &other)
+    {
+        unref();
+        server = other.server;
+        state = std::move(other.state);
+        other.server = nullptr;
+    }
+    return *this;
+}
+
+UDBus::Server::operator DBusServer*() const noexcept
+{
+    return server;
+}
+
+dbus_bool_t UDBus::Server::addWatch(DBusWatch* watch, void* data) noexcept
+{
+    static_cast<State*>(data)->watches.push_back(watch);
+    return TRUE;
+}
+
+void UDBus::Server::removeWatch(DBusWatch* watch, void* data) noexcept
+{
+    auto& watches = static_cast<State*>(data)->watches;
+    std::erase(watches, watch);
+}
+
+void UDBus::Server::newConnection(DBusServer*, DBusConnection* connection, void* data) noexcept
+{
+    // libdbus drops the connection unless a reference is taken here
+    static_cast<State*>(data)->connections.push_back(dbus_connection_ref(connection));
+}
+
+void UDBus::Server::listen(const char* address, UDBus::Error& error) noexcept
+{
+    unref();
+    server = dbus_server_listen(address, error);
+    if (server == nullptr)
+        return;
+
+    state = std::make_unique<State>();
+    dbus_server_set_new_connection_function(server, newConnection, state.get(), nullptr);
+    if (!dbus_server_set_watch_functions(server, addWatch, removeWatch, nullptr, state.get(), nullptr))
+    {
+        error.set(DBUS_ERROR_NO_MEMORY, "Not enough memory to set up the server watches");
+        unref();
+    }
+}
+
+UDBus::Connection UDBus::Server::accept(const int timeout_milliseconds) noexcept
+{
+    if (server == nullptr)
+        return Connection{};
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_milliseconds);
+    std::vector<pollfd> fds;
+    std::vector<DBusWatch*> polled;
+    while (state->connections.empty())
+    {
+        int timeout = -1;
+        if (timeout_milliseconds >= 0)
+        {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            timeout = remaining > 0 ? static_cast<int>(remaining) : 0;
+        }
+
+        fds.clear();
+        polled.clear();
+        for (auto& a : state->watches)
+        {
+            if (!dbus_watch_get_enabled(a))
+                continue;
+
+            const unsigned int flags = dbus_watch_get_flags(a);
+            short events = 0;
+            if (flags & DBUS_WATCH_READABLE)
+                events |= POLLIN;
+            if (flags & DBUS_WATCH_WRITABLE)
+                events |= POLLOUT;
+            fds.push_back(pollfd{ .fd = dbus_watch_get_unix_fd(a), .events = events, .revents = 0 });
+            polled.push_back(a);
+        }
+
+        if (poll(fds.data(), fds.size(), timeout) > 0)
+        {
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                unsigned int flags = 0;
+                if (fds[i].revents & POLLIN)
+                    flags |= DBUS_WATCH_READABLE;
+                if (fds[i].revents & POLLOUT)
+                    flags |= DBUS_WATCH_WRITABLE;
+                if (fds[i].revents & POLLHUP)
+                    flags |= DBUS_WATCH_HANGUP;
+                if (fds[i].revents & POLLERR)
+                    flags |= DBUS_WATCH_ERROR;
+
+                // Handling a watch may add or remove watches, so only handle the ones that are still registered
+                if (flags != 0 && std::ranges::find(state->watches, polled[i]) != state->watches.end())
+                    dbus_watch_handle(polled[i], flags);
+            }
+        }
+
+        if (timeout == 0)
+            break;
+    }
+
+    if (state->connections.empty())
+        return Connection{};
+
+    // Connections accepted by a server are private, so they have to be closed before their last reference is dropped
+    Connection result(state->connections.front());
+    result.bPrivate = true;
+    state->connections.pop_front();
+    return result;
+}
+
+char* UDBus::Server::get_address() const noexcept
+{
+    return dbus_server_get_address(server);
+}
+
+char* UDBus::Server::get_id() const noexcept
+{
+    return dbus_server_get_id(server);
+}
+
+udbus_bool_t UDBus::Server::get_is_connected() const noexcept
+{
+    return dbus_server_get_is_connected(server);
+}
+
+udbus_bool_t UDBus::Server::set_auth_mechanisms(const char** mechanisms) const noexcept
+{
+    return dbus_server_set_auth_mechanisms(server, mechanisms);
+}
+
+void UDBus::Server::disconnect() const noexcept
+{
+    dbus_server_disconnect(server);
+}
+
+void UDBus::Server::unref() noexcept
+{
+    if (server != nullptr)
+    {
+        // A server has to be disconnected before its last reference is dropped
+        dbus_server_disconnect(server);
+        dbus_server_unref(server);
+    }
+    server = nullptr;
+
+    if (state != nullptr)
+    {
+        for (auto& a : state->connections)
+        {
+            dbus_connection_close(a);
+            dbus_connection_unref(a);
+        }
+    }
+    state.reset();
+}
@@ -0,0 +1,215 @@
+#include "DBusUtilsSignals.hpp"
+
+#define UDBUS_PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+UDBus::SignalCoalescer::SignalCoalescer(const std::chrono::milliseconds window, SignalHandler sink) noexcept
+{
+    this->window = window;
+    this->sink = std::move(sink);
+}
+
+std::string UDBus::SignalCoalescer::kindName(const char* interface, const char* member) noexcept
+{
+    std::string result = interface == nullptr ? "" : interface;
+    result += '.';
+    if (member != nullptr)
+        result += member;
+    return result;
+}
+
+void UDBus::SignalCoalescer::coalesce(const char* interface, const char* member) noexcept
+{
+    kinds.insert(kindName(interface, member));
+}
+
+bool UDBus::SignalCoalescer::push(Message& signal) noexcept
+{
+    if (signal.get_type() != DBUS_MESSAGE_TYPE_SIGNAL)
+        return false;
+
+    const char* interface = dbus_message_get_interface(signal);
+    const char* member = dbus_message_get_member(signal);
+    if (!kinds.contains(kindName(interface, member)))
+        return false;
+
+    const char* sender = dbus_message_get_sender(signal);
+    const char* path = dbus_message_get_path(signal);
+
+    // Fields are separated with a character that is not valid in any of them
+    std::string key = sender == nullptr ? "" : sender;
+    key += ' ';
+    key += path == nullptr ? "" : path;
+    key += ' ';
+    key += kindName(interface, member);
+
+    const bool bProperties = signal.is_signal(UDBUS_PROPERTIES_INTERFACE, "PropertiesChanged");
+    const char* propertiesInterface = nullptr;
+    if (bProperties)
+    {
+        DBusMessageIter it;
+        if (!dbus_message_iter_init(signal, &it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_STRING)
+            return false;
+        dbus_message_iter_get_basic(&it, &propertiesInterface);
+        key += ' ';
+        key += propertiesInterface;
+    }
+
+    auto [it, bInserted] = entries.try_emplace(key);
+    auto& entry = it->second;
+    if (bInserted)
+    {
+        entry.deadline = Clock::now() + window;
+        entry.bProperties = bProperties;
+        order.push_back(key);
+    }
+
+    // A malformed PropertiesChanged signal cannot be merged, so the payload seen so far is delivered later, while
+    // this one is dispatched normally
+    if (bProperties && !mergeProperties(entry, signal))
+    {
+        if (bInserted)
+        {
+            entries.erase(it);
+            order.pop_back();
+        }
+        return false;
+    }
+
+    entry.latest = std::move(signal);
+    entry.count++;
+    return true;
+}
+
+bool UDBus::SignalCoalescer::mergeProperties(Entry& entry, Message& signal) noexcept
+{
+    DBusMessageIter it;
+    dbus_message_iter_init(signal, &it);
+    if (!dbus_message_iter_next(&it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_ARRAY)
+        return false;
+
+    // The whole signal is parsed before anything is merged, so that a malformed one leaves the entry untouched
+    std::map<std::string, Message> changed;
+    DBusMessageIter entries;
+    dbus_message_iter_recurse(&it, &entries);
+    for (; dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&entries))
+    {
+        DBusMessageIter dictEntry;
+        const char* name = nullptr;
+        dbus_message_iter_recurse(&entries, &dictEntry);
+        if (dbus_message_iter_get_arg_type(&dictEntry) != DBUS_TYPE_STRING)
+            return false;
+        dbus_message_iter_get_basic(&dictEntry, &name);
+        dbus_message_iter_next(&dictEntry);
+
+        Message value;
+        value.new_1(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+        DBusMessageIter append;
+        dbus_message_iter_init_append(value, &append);
+        if (!value.is_valid() || !Iterator::copy(&dictEntry, &append))
+            return false;
+        changed[name] = std::move(value);
+    }
+
+    std::vector<const char*> invalidated;
+    if (dbus_message_iter_next(&it) && dbus_message_iter_get_arg_type(&it) == DBUS_TYPE_ARRAY)
+    {
+        DBusMessageIter names;
+        dbus_message_iter_recurse(&it, &names);
+        for (; dbus_message_iter_get_arg_type(&names) == DBUS_TYPE_STRING; dbus_message_iter_next(&names))
+        {
+            const char* name = nullptr;
+            dbus_message_iter_get_basic(&names, &name);
+            invalidated.push_back(name);
+        }
+    }
+
+    for (auto& [name, value] : changed)
+    {
+        entry.invalidated.erase(name);
+        entry.changed[name] = std::move(value);
+    }
+    for (const auto& name : invalidated)
+    {
+        entry.changed.erase(name);
+        entry.invalidated.emplace(name);
+    }
+    return true;
+}
+
+UDBus::Message UDBus::SignalCoalescer::buildProperties(Entry& entry) noexcept
+{
+    Message result;
+    result.new_signal(dbus_message_get_path(entry.latest), UDBUS_PROPERTIES_INTERFACE, "PropertiesChanged");
+    if (!result.is_valid())
+        return result;
+    if (const char* sender = dbus_message_get_sender(entry.latest); sender != nullptr)
+        dbus_message_set_sender(result, sender);
+
+    DBusMessageIter it;
+    DBusMessageIter latest;
+    DBusMessageIter array;
+    DBusMessageIter invalidated;
+    dbus_message_iter_init_append(result, &it);
+    dbus_message_iter_init(entry.latest, &latest);
+
+    // The interface name is copied from the newest signal
+    bool bResult = Iterator::copy(&latest, &it) && dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "{sv}", &array);
+    for (auto& [name, value] : entry.changed)
+    {
+        if (!bResult)
+            break;
+
+        DBusMessageIter dictEntry;
+        DBusMessageIter variant;
+        const char* str = name.c_str();
+        dbus_message_iter_init(value, &variant);
+        bResult = dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, nullptr, &dictEntry)
+            && dbus_message_iter_append_basic(&dictEntry, DBUS_TYPE_STRING, &str)
+            && Iterator::copy(&variant, &dictEntry)
+            && dbus_message_iter_close_container(&array, &dictEntry);
+    }
+    bResult = bResult && dbus_message_iter_close_container(&it, &array) && dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "s", &invalidated);
+    for (const auto& a : entry.invalidated)
+    {
+        if (!bResult)
+            break;
+        const char* str = a.c_str();
+        bResult = dbus_message_iter_append_basic(&invalidated, DBUS_TYPE_STRING, &str);
+    }
+    bResult = bResult && dbus_message_iter_close_container(&it, &invalidated);
+
+    // Fall back to the newest signal on OOM, it is better than losing the update completely
+    if (!bResult)
+        return std::move(entry.latest);
+    return result;
+}
+
+size_t UDBus::SignalCoalescer::flush(const Clock::time_point now) noexcept
+{
+    size_t delivered = 0;
+    while (!order.empty())
+    {
+        const auto it = entries.find(order.front());
+        if (it->second.deadline > now)
+            break;
+
+        // Take the entry out before calling the sink, as the sink may push new signals
+        auto entry = std::move(it->second);
+        entries.erase(it);
+        order.pop_front();
+
+        // A single signal does not need to be merged with anything
+        Message message = entry.bProperties && entry.count > 1 ? buildProperties(entry) : std::move(entry.latest);
+        if (message.is_valid())
+        {
+            sink(message);
+            delivered++;
+        }
+    }
+    return delivered;
+}
+
+size_t UDBus::SignalCoalescer::size() const noexcept
+{
+    return entries.size();
+}
@@ -0,0 +1,308 @@
+#include "DBusUtilsSignals.hpp"
+#include <algorithm>
+#include <ranges>
+
+UDBus::SignalRouter::SignalRouter(const Connection& connection) noexcept : owners(connection)
+{
+    this->connection = &connection;
+    // Only connections to a bus get a unique name
+    bBus = dbus_bus_get_unique_name(connection) != nullptr;
+    owners.set_handler([this](const char* name, const char* oldOwner, const char* newOwner) -> void
+    {
+        onOwnerChanged(name, oldOwner, newOwner);
+    });
+}
+
+std::string UDBus::SignalRouter::buildRule(const MatchRule& rule) noexcept
+{
+    std::string result = "type='signal'";
+    const auto add = [&result](const char* key, const char* value) -> void
+    {
+        if (value != nullptr)
+            result += std::string(",") + key + "='" + value + "'";
+    };
+
+    add("sender", rule.sender);
+    if (rule.path != nullptr)
+        add("path", rule.path);
+    else
+        add("path_namespace", rule.path_namespace);
+    add("interface", rule.interface);
+    add("member", rule.member);
+    add("arg0", rule.arg0);
+    return result;
+}
+
+bool UDBus::SignalRouter::isWellKnown(const std::string& sender) const noexcept
+{
+    // Peers on peer-to-peer connections have no names to resolve
+    return bBus && !sender.empty() && sender[0] != ':' && sender != DBUS_SERVICE_DBUS;
+}
+
+std::unique_ptr<UDBus::SignalRouter::Node>* UDBus::SignalRouter::child(Node& node, const Subscription& subscription, const size_t level) noexcept
+{
+    const auto& field = subscription.fields[level];
+    if (field.empty())
+        return &node.any;
+    if (level == LEVEL_PATH && subscription.bNamespace)
+        return &node.prefix[field];
+    return &node.exact[field];
+}
+
+UDBus::SignalRouter::Node& UDBus::SignalRouter::leaf(const Subscription& subscription) noexcept
+{
+    Node* node = &root;
+    for (size_t level = 0; level < LEVEL_COUNT; level++)
+    {
+        auto* next = child(*node, subscription, level);
+        if (*next == nullptr)
+            *next = std::make_unique<Node>();
+        node = next->get();
+    }
+    return *node;
+}
+
+bool UDBus::SignalRouter::prune(Node& node, const Subscription& subscription, const size_t id, const size_t level) noexcept
+{
+    if (level == LEVEL_COUNT)
+    {
+        node.subscriptions.erase(std::ranges::find(node.subscriptions, id));
+        return node.subscriptions.empty();
+    }
+
+    const auto& field = subscription.fields[level];
+    if (field.empty())
+    {
+        if (node.any != nullptr && prune(*node.any, subscription, id, level + 1))
+            node.any.reset();
+    }
+    else
+    {
+        auto& children = level == LEVEL_PATH && subscription.bNamespace ? node.prefix : node.exact;
+        if (const auto it = children.find(field); it != children.end() && prune(*it->second, subscription, id, level + 1))
+            children.erase(it);
+    }
+    return node.exact.empty() && node.prefix.empty() && node.any == nullptr && node.subscriptions.empty();
+}
+
+size_t UDBus::SignalRouter::subscribe(const MatchRule& rule, SignalHandler handler, Error& error) noexcept
+{
+    Subscription subscription{
+        .fields = {},
+        .bNamespace = rule.path == nullptr && rule.path_namespace != nullptr,
+        .rule = buildRule(rule),
+        .handler = std::move(handler),
+    };
+
+    const char* fields[LEVEL_COUNT] = { rule.sender, rule.path != nullptr ? rule.path : rule.path_namespace, rule.interface, rule.member, rule.arg0 };
+    for (size_t i = 0; i < LEVEL_COUNT; i++)
+        if (fields[i] != nullptr)
+            subscription.fields[i] = fields[i];
+
+    // The first subscription to a well-known sender starts tracking its owner, before the match rule is added so
+    // that a failure leaves nothing to undo on the bus
+    const auto& sender = subscription.fields[LEVEL_SENDER];
+    const bool bWellKnown = isWellKnown(sender);
+    if (bWellKnown && senderReferences[sender]++ == 0)
+    {
+        if (!owners.track(sender.c_str(), error))
+        {
+            senderReferences.erase(sender);
+            return 0;
+        }
+        if (const char* owner = owners.get_owner(sender.c_str()); owner != nullptr)
+            ownedNames[owner].push_back(sender);
+    }
+
+    // Only the first subscription with a given rule registers it on the bus. Peer-to-peer connections have no bus,
+    // so peers send their signals directly and there is nothing to register
+    auto& references = ruleReferences[subscription.rule];
+    if (references == 0 && bBus)
+    {
+        dbus_bus_add_match(*connection, subscription.rule.c_str(), error);
+        if (error.is_set())
+        {
+            ruleReferences.erase(subscription.rule);
+            if (bWellKnown)
+                releaseSender(sender);
+            return 0;
+        }
+    }
+    references++;
+
+    const size_t id = nextID++;
+    leaf(subscription).subscriptions.push_back(id);
+    subscriptions.emplace(id, std::move(subscription));
+    return id;
+}
+
+void UDBus::SignalRouter::releaseSender(const std::string& sender) noexcept
+{
+    const auto it = senderReferences.find(sender);
+    if (it == senderReferences.end() || --it->second > 0)
+        return;
+
+    // Copied, as the key goes away with the entry
+    const std::string name = sender;
+    senderReferences.erase(it);
+    if (const char* owner = owners.get_owner(name.c_str()); owner != nullptr)
+        onOwnerChanged(name.c_str(), owner, "");
+    owners.untrack(name.c_str());
+}
+
+void UDBus::SignalRouter::onOwnerChanged(const char* name, const char* oldOwner, const char* newOwner) noexcept
+{
+    if (oldOwner != nullptr && oldOwner[0] != '\0')
+    {
+        if (const auto it = ownedNames.find(std::string_view(oldOwner)); it != ownedNames.end())
+        {
+            std::erase(it->second, name);
+            if (it->second.empty())
+                ownedNames.erase(it);
+        }
+    }
+    if (newOwner != nullptr && newOwner[0] != '\0')
+        ownedNames[newOwner].emplace_back(name);
+}
+
+bool UDBus::SignalRouter::unsubscribe(const size_t id) noexcept
+{
+    const auto it = subscriptions.find(id);
+    if (it == subscriptions.end() || it->second.bRemoved)
+        return false;
+
+    prune(root, it->second, id, 0);
+
+    if (const auto references = ruleReferences.find(it->second.rule); references != ruleReferences.end() && --references->second == 0)
+    {
+        // Passing a null error sends RemoveMatch without waiting for the reply
+        if (bBus)
+            dbus_bus_remove_match(*connection, references->first.c_str(), nullptr);
+        ruleReferences.erase(references);
+    }
+
+    if (isWellKnown(it->second.fields[LEVEL_SENDER]))
+        releaseSender(it->second.fields[LEVEL_SENDER]);
+
+    // The handler may be the one that is running, so it is only destroyed once dispatch returns
+    if (dispatchDepth > 0)
+    {
+        it->second.bRemoved = true;
+        removed.push_back(id);
+    }
+    else
+        subscriptions.erase(it);
+    return true;
+}
+
+void UDBus::SignalRouter::collect(const Node& node, const size_t level, const char* const* fields, std::vector<size_t>& result) const noexcept
+{
+    if (level == LEVEL_COUNT)
+    {
+        result.insert(result.end(), node.subscriptions.begin(), node.subscriptions.end());
+        return;
+    }
+
+    if (node.any != nullptr)
+        collect(*node.any, level + 1, fields, result);
+
+    const char* field = fields[level];
+    if (field == nullptr)
+        return;
+
+    if (const auto it = node.exact.find(std::string_view(field)); it != node.exact.end())
+        collect(*it->second, level + 1, fields, result);
+
+    // Signals carry the unique name of their sender, subscriptions to the well-known names it owns match as well
+    if (level == LEVEL_SENDER)
+        if (const auto owned = ownedNames.find(std::string_view(field)); owned != ownedNames.end())
+            for (const auto& name : owned->second)
+                if (const auto it = node.exact.find(name); it != node.exact.end())
+                    collect(*it->second, level + 1, fields, result);
+
+    // A path namespace matches the path itself and every path below it, so look up every prefix of the path that
+    // ends at a component boundary. "/" matches all paths
+    if (level == LEVEL_PATH && !node.prefix.empty())
+    {
+        const std::string_view path = field;
+        for (size_t i = 0; i <= path.size(); i++)
+        {
+            if (i != path.size() && (path[i] != '/' || i == 0))
+                continue;
+
+            if (const auto it = node.prefix.find(path.substr(0, i)); it != node.prefix.end())
+                collect(*it->second, level + 1, fields, result);
+        }
+        if (path != "/")
+            if (const auto it = node.prefix.find(std::string_view("/")); it != node.prefix.end())
+                collect(*it->second, level + 1, fields, result);
+    }
+}
+
+size_t UDBus::SignalRouter::dispatch(Message& message) noexcept
+{
+    if (message.get_type() != DBUS_MESSAGE_TYPE_SIGNAL)
+        return 0;
+    if (!senderReferences.empty())
+        owners.handleSignal(message);
+
+    const char* arg0 = nullptr;
+    DBusMessageIter it;
+    if (dbus_message_iter_init(message, &it))
+    {
+        const int type = dbus_message_iter_get_arg_type(&it);
+        if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_SIGNATURE)
+            dbus_message_iter_get_basic(&it, &arg0);
+    }
+
+    const char* fields[LEVEL_COUNT] = {
+        dbus_message_get_sender(message),
+        dbus_message_get_path(message),
+        dbus_message_get_interface(message),
+        dbus_message_get_member(message),
+        arg0
+    };
+
+    std::vector<size_t> matches;
+    collect(root, 0, fields, matches);
+
+    size_t called = 0;
+    dispatchDepth++;
+    for (const auto& a : matches)
+    {
+        // Handlers may unsubscribe other handlers, or themselves, so look every one of them up again. Subscriptions
+        // are not erased during dispatch and the map does not move its elements, so the handler stays valid while it runs
+        const auto subscription = subscriptions.find(a);
+        if (subscription == subscriptions.end() || subscription->second.bRemoved)
+            continue;
+
+        subscription->second.handler(message);
+        called++;
+    }
+    if (--dispatchDepth == 0)
+    {
+        for (const auto& a : removed)
+            subscriptions.erase(a);
+        removed.clear();
+    }
+    if (called > 0)
+        trace(TRACE_HANDLER_END, message);
+    return called;
+}
+
+size_t UDBus::SignalRouter::size() const noexcept
+{
+    return subscriptions.size() - removed.size();
+}
+
+size_t UDBus::SignalRouter::rules() const noexcept
+{
+    return ruleReferences.size();
+}
+
+UDBus::SignalRouter::~SignalRouter() noexcept
+{
+    if (bBus)
+        for (const auto& a : ruleReferences | std::views::keys)
+            dbus_bus_remove_match(*connection, a.c_str(), nullptr);
+}
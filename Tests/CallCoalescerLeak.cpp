@@ -0,0 +1,93 @@
+// Makes coalesced asynchronous calls over a peer-to-peer connection and checks that every completed flight releases
+// its reply. A flight that is never freed keeps its reply alive, so the free function of a data slot attached to the
+// reply is what detects the leak.
+#include "DBusUtilsAsync.hpp"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+#define DISTINCT_CALLS 10
+#define CALLS_PER_KEY 10
+
+static std::atomic<int> freedReplies = 0;
+
+static void onReplyFreed(void*) noexcept
+{
+    freedReplies++;
+}
+
+int main()
+{
+    UDBus::Error error;
+    UDBus::Server server;
+    server.listen("unix:tmpdir=/tmp", error);
+    if (error.is_set())
+    {
+        fprintf(stderr, "Couldn't listen: %s\n", error.message());
+        return 1;
+    }
+
+    char* address = server.get_address();
+    std::atomic<bool> bDone = false;
+    std::thread peer([&]() -> void
+    {
+        auto connection = server.accept(5000);
+        while (!bDone && connection.read_write(10))
+        {
+            for (auto call = connection.pop_message(); call.is_valid(); call = connection.pop_message())
+            {
+                if (call.get_type() != DBUS_MESSAGE_TYPE_METHOD_CALL)
+                    continue;
+                UDBus::Message reply;
+                reply.new_method_return(call);
+                connection.send(reply, nullptr);
+            }
+            connection.flush();
+        }
+        connection.close();
+    });
+
+    dbus_int32_t slot = -1;
+    dbus_message_allocate_data_slot(&slot);
+
+    int completed = 0;
+    {
+        UDBus::Connection connection;
+        connection.open_private(address, error);
+        dbus_free(address);
+        if (error.is_set())
+        {
+            fprintf(stderr, "Couldn't connect: %s\n", error.message());
+            bDone = true;
+            peer.join();
+            return 1;
+        }
+
+        UDBus::CallCoalescer coalescer(connection);
+        for (int i = 0; i < DISTINCT_CALLS * CALLS_PER_KEY; i++)
+        {
+            UDBus::Message call;
+            call.new_method_call(nullptr, "/leak", "org.udbus.Leak", "Call");
+            const dbus_int32_t key = i % DISTINCT_CALLS;
+            dbus_message_append_args(call, DBUS_TYPE_INT32, &key, DBUS_TYPE_INVALID);
+            (void)coalescer.send_with_reply(call, [&](UDBus::Message& reply, UDBus::Error&) -> void
+            {
+                completed++;
+                // Every waiter of a flight gets the same reply, the slot is only set once per flight
+                if (reply.is_valid() && dbus_message_get_data(reply, slot) == nullptr)
+                    dbus_message_set_data(reply, slot, &freedReplies, onReplyFreed);
+            }, DBUS_TIMEOUT_USE_DEFAULT);
+        }
+
+        for (int i = 0; i < 500 && completed < DISTINCT_CALLS * CALLS_PER_KEY; i++)
+            while (connection.read_write_dispatch(10) && dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS);
+        connection.close();
+    }
+
+    bDone = true;
+    peer.join();
+    dbus_message_free_data_slot(&slot);
+
+    printf("completed %d calls, freed %d of %d replies\n", completed, freedReplies.load(), DISTINCT_CALLS);
+    return completed == DISTINCT_CALLS * CALLS_PER_KEY && freedReplies == DISTINCT_CALLS ? 0 : 1;
+}
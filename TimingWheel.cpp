@@ -0,0 +1,160 @@
+#include "DBusUtilsAsync.hpp"
+
+UDBus::TimingWheel::TimingWheel(const std::chrono::milliseconds resolution) noexcept
+{
+    this->resolution = resolution.count() > 0 ? Clock::duration(resolution) : Clock::duration(std::chrono::milliseconds(1));
+    epoch = Clock::now();
+    for (auto& a : heads)
+        a = NONE;
+}
+
+uint64_t UDBus::TimingWheel::toTicks(const Clock::time_point time) const noexcept
+{
+    if (time <= epoch)
+        return 0;
+    return static_cast<uint64_t>((time - epoch) / resolution);
+}
+
+void UDBus::TimingWheel::link(const uint32_t index) noexcept
+{
+    auto& node = nodes[index];
+
+    // Deadlines that are further away than the wheel can represent are parked in the farthest slot of the top level.
+    // Once cascaded they are placed again using their real expiry, which eventually brings them into range
+    constexpr uint64_t maxDelta = (1ull << (LEVEL_BITS * LEVELS)) - 1;
+    const uint64_t delta = node.expiry - currentTick;
+    const uint64_t expiry = delta > maxDelta ? currentTick + maxDelta : node.expiry;
+
+    size_t level = 0;
+    while (level + 1 < LEVELS && (delta > maxDelta ? maxDelta : delta) >= (1ull << (LEVEL_BITS * (level + 1))))
+        level++;
+
+    node.slot = static_cast<uint32_t>((level * LEVEL_SLOTS) + ((expiry >> (LEVEL_BITS * level)) & (LEVEL_SLOTS - 1)));
+    node.prev = NONE;
+    node.next = heads[node.slot];
+    if (node.next != NONE)
+        nodes[node.next].prev = index;
+    heads[node.slot] = index;
+}
+
+void UDBus::TimingWheel::unlink(const uint32_t index) noexcept
+{
+    auto& node = nodes[index];
+    if (node.prev != NONE)
+        nodes[node.prev].next = node.next;
+    else
+        heads[node.slot] = node.next;
+
+    if (node.next != NONE)
+        nodes[node.next].prev = node.prev;
+    node.prev = NONE;
+    node.next = NONE;
+}
+
+void UDBus::TimingWheel::release(const uint32_t index) noexcept
+{
+    auto& node = nodes[index];
+    node.slot = NONE;
+    // Bumping the generation invalidates all handles that still point to this node. 0 is skipped so that a handle
+    // can never be 0
+    if (++node.generation == 0)
+        node.generation = 1;
+    freeNodes.push_back(index);
+    count--;
+}
+
+void UDBus::TimingWheel::cascade(const size_t level) noexcept
+{
+    const size_t slot = (level * LEVEL_SLOTS) + ((currentTick >> (LEVEL_BITS * level)) & (LEVEL_SLOTS - 1));
+    uint32_t index = heads[slot];
+    heads[slot] = NONE;
+    while (index != NONE)
+    {
+        const uint32_t next = nodes[index].next;
+        link(index);
+        index = next;
+    }
+}
+
+UDBus::TimingWheel::Handle UDBus::TimingWheel::insert(const Clock::time_point deadline, const uint64_t value) noexcept
+{
+    uint32_t index;
+    if (!freeNodes.empty())
+    {
+        index = freeNodes.back();
+        freeNodes.pop_back();
+    }
+    else
+    {
+        index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+    }
+
+    // Round the deadline up, so that timers never fire early. Expired deadlines fire on the next tick
+    auto& node = nodes[index];
+    uint64_t expiry = toTicks(deadline);
+    if (epoch + (resolution * expiry) < deadline)
+        expiry++;
+    node.expiry = expiry > currentTick ? expiry : currentTick + 1;
+    node.value = value;
+    link(index);
+    count++;
+
+    return (static_cast<uint64_t>(node.generation) << 32) | index;
+}
+
+bool UDBus::TimingWheel::cancel(const Handle handle) noexcept
+{
+    const auto index = static_cast<uint32_t>(handle & UINT32_MAX);
+    const auto generation = static_cast<uint32_t>(handle >> 32);
+    if (index >= nodes.size() || nodes[index].generation != generation || nodes[index].slot == NONE)
+        return false;
+
+    unlink(index);
+    release(index);
+    return true;
+}
+
+size_t UDBus::TimingWheel::advance(const Clock::time_point now, const std::function<void(std::vector<uint64_t>&)>& expired) noexcept
+{
+    const uint64_t target = toTicks(now);
+    std::vector<uint64_t> values;
+    while (currentTick < target)
+    {
+        // Nothing can expire on an empty wheel, so skip straight to the target
+        if (count == 0)
+        {
+            currentTick = target;
+            break;
+        }
+        currentTick++;
+
+        // When the lower levels wrap around, pull the timers of the next slot of the upper levels down. Higher levels
+        // go first, so that their timers can be cascaded further down on the same tick
+        size_t levels = 0;
+        while (levels + 1 < LEVELS && (currentTick & ((1ull << (LEVEL_BITS * (levels + 1))) - 1)) == 0)
+            levels++;
+        for (size_t level = levels; level > 0; level--)
+            cascade(level);
+
+        const size_t slot = currentTick & (LEVEL_SLOTS - 1);
+        uint32_t index = heads[slot];
+        heads[slot] = NONE;
+        while (index != NONE)
+        {
+            const uint32_t next = nodes[index].next;
+            values.push_back(nodes[index].value);
+            release(index);
+            index = next;
+        }
+    }
+
+    if (!values.empty())
+        expired(values);
+    return values.size();
+}
+
+size_t UDBus::TimingWheel::size() const noexcept
+{
+    return count;
+}
@@ -0,0 +1,435 @@
+// Microbenchmarks for the encoding and decoding paths of the library, as well as round trips over a peer-to-peer
+// connection. Everything runs in-process, so no bus daemon is needed.
+//
+// Usage: udbus_bench [--filter <substring>] [--min-time <milliseconds>]
+//
+// Results are printed to stdout as JSON, so that runs on different commits can be compared with any JSON tool.
+#include "DBusUtilsWire.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <atomic>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchmarkResult
+{
+    std::string name{};
+    size_t iterations = 0;
+    double nanosecondsPerOp = 0;
+    // The marshalled size of the message that the benchmark builds, decodes or sends
+    size_t bytesPerOp = 0;
+};
+
+static const char* filter = nullptr;
+static std::chrono::milliseconds minTime{200};
+static std::vector<BenchmarkResult> results{};
+
+// Runs the function in growing batches until the total time exceeds minTime
+template<typename F>
+static void run(const std::string& name, const size_t bytesPerOp, F&& f) noexcept
+{
+    if (filter != nullptr && name.find(filter) == std::string::npos)
+        return;
+
+    // Warm up caches and allocators
+    f();
+
+    size_t iterations = 0;
+    size_t batch = 1;
+    Clock::duration total{};
+    while (total < minTime)
+    {
+        const auto start = Clock::now();
+        for (size_t i = 0; i < batch; i++)
+            f();
+        total += Clock::now() - start;
+        iterations += batch;
+        batch *= 2;
+    }
+
+    results.push_back({
+        .name = name,
+        .iterations = iterations,
+        .nanosecondsPerOp = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(total).count()) / static_cast<double>(iterations),
+        .bytesPerOp = bytesPerOp,
+    });
+    fprintf(stderr, "%-40s %14.1f ns/op\n", name.c_str(), results.back().nanosecondsPerOp);
+}
+
+static size_t marshalledSize(const UDBus::Message& message) noexcept
+{
+    char* data = nullptr;
+    int length = 0;
+    if (!message.marshal(&data, &length))
+        return 0;
+    dbus_free(data);
+    return static_cast<size_t>(length);
+}
+
+static UDBus::Message newCall() noexcept
+{
+    UDBus::Message message;
+    message.new_method_call("com.example.Bench", "/com/example/Bench", "com.example.Bench", "Echo");
+    return message;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Payload shapes. Every builder appends one argument to an empty method call
+// ---------------------------------------------------------------------------------------------------------------------
+
+static std::vector<std::string> propertyNames{};
+
+static void buildProperties(UDBus::Message& message, const size_t count) noexcept
+{
+    UDBus::MessageBuilder builder(message);
+    builder << UDBus::BeginArray;
+    for (size_t i = 0; i < count; i++)
+    {
+        builder << UDBus::BeginDictEntry << propertyNames[i].c_str() << UDBus::BeginVariant;
+        if (i % 2 == 0)
+            builder << static_cast<int32_t>(i);
+        else
+            builder << propertyNames[i].c_str();
+        builder << UDBus::EndVariant << UDBus::EndDictEntry;
+    }
+    builder << UDBus::EndArray << UDBus::EndMessage;
+}
+
+static void buildRecords(UDBus::Message& message, const size_t count) noexcept
+{
+    const char* first = "first name";
+    const char* last = "last name";
+
+    UDBus::MessageBuilder builder(message);
+    builder << UDBus::BeginArray;
+    for (size_t i = 0; i < count; i++)
+        builder << UDBus::BeginStruct << static_cast<int32_t>(i) << static_cast<int32_t>(i * 2) << first << last << UDBus::EndStruct;
+    builder << UDBus::EndArray << UDBus::EndMessage;
+}
+
+static void buildBytes(UDBus::Message& message, const std::vector<uint8_t>& bytes) noexcept
+{
+    UDBus::MessageBuilder builder(message);
+    builder << bytes << UDBus::EndMessage;
+}
+
+#define NESTING_DEPTH 16
+
+static void buildNested(UDBus::Message& message) noexcept
+{
+    UDBus::MessageBuilder builder(message);
+    for (int32_t i = 0; i < NESTING_DEPTH; i++)
+        builder << UDBus::BeginStruct << i;
+    for (int32_t i = 0; i < NESTING_DEPTH; i++)
+        builder << UDBus::EndStruct;
+    builder << UDBus::EndMessage;
+}
+
+// Schemas for the nested payload, (i(i(i...))) with one Struct per level
+template<size_t N>
+struct Nested
+{
+    using Schema = UDBus::Struct<int32_t, typename Nested<N - 1>::Schema>;
+
+    int32_t value = 0;
+    Nested<N - 1> inner{};
+    Schema schema{};
+
+    void init() noexcept
+    {
+        inner.init();
+        schema.init(value, inner.schema);
+    }
+};
+
+template<>
+struct Nested<1>
+{
+    using Schema = UDBus::Struct<int32_t>;
+
+    int32_t value = 0;
+    Schema schema{};
+
+    void init() noexcept
+    {
+        schema.init(value);
+    }
+};
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Benchmarks
+// ---------------------------------------------------------------------------------------------------------------------
+
+static void benchmarkProperties(const size_t count) noexcept
+{
+    auto sample = newCall();
+    buildProperties(sample, count);
+    const auto size = marshalledSize(sample);
+    const auto suffix = "/" + std::to_string(count);
+
+    run("encode/a{sv}" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        buildProperties(message, count);
+    });
+
+    run("decode/a{sv}" + suffix, size, [&]() -> void
+    {
+        std::map<const char*, UDBus::Variant> properties;
+        int32_t integers = 0;
+        const char* string = nullptr;
+        UDBus::Variant variant{
+            .parse = [&](UDBus::Message&, UDBus::Iterator& it, void**, void*) -> bool
+            {
+                const auto type = it.get_arg_type();
+                if (type == DBUS_TYPE_INT32)
+                {
+                    int32_t value;
+                    it.get_basic(&value);
+                    integers += value;
+                    return true;
+                }
+                if (type == DBUS_TYPE_STRING)
+                {
+                    it.get_basic(&string);
+                    return true;
+                }
+                return false;
+            }
+        };
+        UDBus::Type<UDBus::ContainerVariantTemplate<std::map<const char*, UDBus::Variant>>> schema(UDBus::associateWithVariant(properties, variant));
+        (void)sample.handleMessage(schema);
+        delete schema.data;
+    });
+}
+
+static void benchmarkRecords(const size_t count) noexcept
+{
+    using Record = UDBus::Struct<int32_t, int32_t, const char*, const char*>;
+
+    auto sample = newCall();
+    buildRecords(sample, count);
+    const auto size = marshalledSize(sample);
+    const auto suffix = "/" + std::to_string(count);
+
+    run("encode/a(iiss)" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        buildRecords(message, count);
+    });
+
+    // The same payload written by the native marshaller from a schema
+    std::vector<int32_t> numbers(count);
+    const char* first = "first name";
+    const char* last = "last name";
+    std::vector<Record> input;
+    input.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        numbers[i] = static_cast<int32_t>(i);
+        input.emplace_back(numbers[i], numbers[i], first, last);
+    }
+    UDBus::NativeMarshaller marshaller;
+    run("encode-native/a(iiss)" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        UDBus::Error error;
+        UDBus::Type<std::vector<Record>, UDBus::BumpType> schema(input, UDBus::bump());
+        (void)marshaller.build(message, schema, error);
+    });
+
+    run("decode/a(iiss)" + suffix, size, [&]() -> void
+    {
+        std::vector<Record> records;
+        // The bump is only there because single-field schemas can't be destroyed
+        UDBus::Type<std::vector<Record>, UDBus::BumpType> schema(records, UDBus::bump());
+        (void)sample.handleMessage(schema);
+        UDBUS_FREE_TYPE(schema);
+    });
+}
+
+static void benchmarkBytes(const size_t count) noexcept
+{
+    const std::vector<uint8_t> bytes(count, 0x5A);
+    auto sample = newCall();
+    buildBytes(sample, bytes);
+    const auto size = marshalledSize(sample);
+    const auto suffix = "/" + std::to_string(count);
+
+    run("encode/ay" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        buildBytes(message, bytes);
+    });
+
+    // Schemas point at their values, so they need a copy they can refer to
+    auto input = bytes;
+    UDBus::NativeMarshaller marshaller;
+    run("encode-native/ay" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        UDBus::Error error;
+        UDBus::Type<std::vector<uint8_t>, UDBus::BumpType> schema(input, UDBus::bump());
+        (void)marshaller.build(message, schema, error);
+    });
+
+    run("decode/ay" + suffix, size, [&]() -> void
+    {
+        std::vector<uint8_t> result;
+        UDBus::Type<std::vector<uint8_t>> schema(result);
+        (void)sample.handleMessage(schema);
+    });
+}
+
+static void benchmarkNesting() noexcept
+{
+    auto sample = newCall();
+    buildNested(sample);
+    const auto size = marshalledSize(sample);
+    const auto suffix = "/" + std::to_string(NESTING_DEPTH);
+
+    run("encode/nested" + suffix, size, [&]() -> void
+    {
+        auto message = newCall();
+        buildNested(message);
+    });
+
+    run("decode/nested" + suffix, size, [&]() -> void
+    {
+        Nested<NESTING_DEPTH> nested;
+        nested.init();
+        UDBus::Type<Nested<NESTING_DEPTH>::Schema> schema(nested.schema);
+        (void)sample.handleMessage(schema);
+    });
+}
+
+// Round trips a method call through an echo service on the other end of a peer-to-peer connection
+static void benchmarkRoundTrips() noexcept
+{
+    UDBus::Error error;
+    UDBus::Server server;
+    server.listen("unix:tmpdir=/tmp", error);
+    if (error.is_set())
+    {
+        fprintf(stderr, "Couldn't listen for peer-to-peer connections: %s\n", error.message());
+        return;
+    }
+
+    char* address = server.get_address();
+    std::atomic<bool> bRunning = true;
+    std::thread service([&]() -> void
+    {
+        auto peer = server.accept(5000);
+        if (static_cast<DBusConnection*>(peer) == nullptr)
+            return;
+
+        while (bRunning && peer.read_write(100))
+        {
+            for (auto message = peer.pop_message(); message.is_valid(); message = peer.pop_message())
+            {
+                if (message.get_type() != DBUS_MESSAGE_TYPE_METHOD_CALL)
+                    continue;
+
+                // Echo the arguments back
+                UDBus::Message reply;
+                reply.new_method_return(message);
+                DBusMessageIter src, dest;
+                dbus_message_iter_init_append(reply, &dest);
+                if (dbus_message_iter_init(message, &src))
+                {
+                    do
+                    {
+                        UDBus::Iterator::copy(&src, &dest);
+                    } while (dbus_message_iter_next(&src));
+                }
+                peer.send(reply, nullptr);
+            }
+            peer.flush();
+        }
+    });
+
+    UDBus::Connection connection;
+    connection.open_private(address, error);
+    dbus_free(address);
+    if (error.is_set())
+    {
+        fprintf(stderr, "Couldn't connect to the echo service: %s\n", error.message());
+        bRunning = false;
+        service.join();
+        return;
+    }
+
+    const auto roundTrip = [&](const std::string& name, UDBus::Message& sample) -> void
+    {
+        run(name, marshalledSize(sample), [&]() -> void
+        {
+            // send_with_reply_and_block locks the message, so every iteration sends a fresh copy
+            UDBus::Message message(dbus_message_copy(sample));
+            UDBus::Error err;
+            auto reply = connection.send_with_reply_and_block(message, 5000, err);
+        });
+    };
+
+    auto empty = newCall();
+    roundTrip("roundtrip/empty", empty);
+
+    auto properties = newCall();
+    buildProperties(properties, 16);
+    roundTrip("roundtrip/a{sv}/16", properties);
+
+    auto bytes = newCall();
+    buildBytes(bytes, std::vector<uint8_t>(64 * 1024, 0x5A));
+    roundTrip("roundtrip/ay/65536", bytes);
+
+    bRunning = false;
+    connection.close();
+    service.join();
+}
+
+static void printResults() noexcept
+{
+    printf("{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const auto& a = results[i];
+        const double seconds = a.nanosecondsPerOp / 1e9;
+        printf("    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, \"bytes_per_op\": %zu, \"mb_per_second\": %.2f}%s\n",
+               a.name.c_str(), a.iterations, a.nanosecondsPerOp, a.bytesPerOp,
+               seconds > 0 ? static_cast<double>(a.bytesPerOp) / seconds / 1e6 : 0.0, i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            minTime = std::chrono::milliseconds(strtol(argv[++i], nullptr, 10));
+        else
+        {
+            fprintf(stderr, "Usage: %s [--filter <substring>] [--min-time <milliseconds>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < 256; i++)
+        propertyNames.push_back("Property" + std::to_string(i));
+
+    benchmarkProperties(16);
+    benchmarkProperties(256);
+    benchmarkRecords(16);
+    benchmarkRecords(1024);
+    for (const size_t a : { 1024ul, 64ul * 1024, 1024ul * 1024, 16ul * 1024 * 1024 })
+        benchmarkBytes(a);
+    benchmarkNesting();
+    benchmarkRoundTrips();
+
+    printResults();
+    return 0;
+}
@@ -0,0 +1,307 @@
+// A load generator that measures the method call throughput and latency distribution a connection sustains. It starts
+// an echo service, either behind a peer-to-peer socket or on the session bus, and drives it with a configurable number
+// of client connections, calls in flight per connection and payload shape, all sent through send_with_reply.
+//
+// Usage: udbus-load [options]
+//   --bus                 Use the session bus instead of a peer-to-peer socket
+//   --connections <n>     The number of client connections, each with its own thread (default 1)
+//   --concurrency <n>     The number of calls in flight per connection (default 16)
+//   --duration <seconds>  How long to run for (default 5)
+//   --signature <sig>     The payload: empty, ay, as, a{sv} or a(iiss) (default ay)
+//   --size <n>            Bytes for ay, elements for the other signatures (default 256)
+#include "DBusUtilsConcurrency.hpp"
+#include "DBusUtilsStats.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+
+#define LOAD_SERVICE_NAME "com.example.UDBusLoad"
+#define LOAD_OBJECT_PATH "/com/example/UDBusLoad"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    bool bBus = false;
+    size_t connections = 1;
+    size_t concurrency = 16;
+    std::chrono::seconds duration{5};
+    std::string signature = "ay";
+    size_t size = 256;
+};
+
+static bool parseOptions(const int argc, char** argv, Options& options) noexcept
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const bool bHasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--bus") == 0)
+            options.bBus = true;
+        else if (strcmp(argv[i], "--connections") == 0 && bHasValue)
+            options.connections = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--concurrency") == 0 && bHasValue)
+            options.concurrency = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--duration") == 0 && bHasValue)
+            options.duration = std::chrono::seconds(strtol(argv[++i], nullptr, 10));
+        else if (strcmp(argv[i], "--signature") == 0 && bHasValue)
+            options.signature = argv[++i];
+        else if (strcmp(argv[i], "--size") == 0 && bHasValue)
+            options.size = strtoul(argv[++i], nullptr, 10);
+        else
+            return false;
+    }
+    return options.connections > 0 && options.concurrency > 0;
+}
+
+static bool buildPayload(UDBus::Message& message, const Options& options) noexcept
+{
+    static const char* text = "The quick brown fox jumps over the lazy dog";
+
+    message.new_method_call(options.bBus ? LOAD_SERVICE_NAME : nullptr, LOAD_OBJECT_PATH, LOAD_SERVICE_NAME, "Echo");
+    UDBus::MessageBuilder builder(message);
+    if (options.signature == "ay")
+        builder << std::vector<uint8_t>(options.size, 0x5A);
+    else if (options.signature == "as")
+        builder << std::vector<const char*>(options.size, text);
+    else if (options.signature == "a{sv}")
+    {
+        builder << UDBus::BeginArray;
+        for (size_t i = 0; i < options.size; i++)
+            builder << UDBus::BeginDictEntry << text << UDBus::BeginVariant << static_cast<int32_t>(i) << UDBus::EndVariant << UDBus::EndDictEntry;
+        builder << UDBus::EndArray;
+    }
+    else if (options.signature == "a(iiss)")
+    {
+        builder << UDBus::BeginArray;
+        for (size_t i = 0; i < options.size; i++)
+            builder << UDBus::BeginStruct << static_cast<int32_t>(i) << static_cast<int32_t>(i) << text << text << UDBus::EndStruct;
+        builder << UDBus::EndArray;
+    }
+    else if (options.signature != "empty")
+        return false;
+    builder << UDBus::EndMessage;
+    return true;
+}
+
+// Replies to every method call with a copy of its arguments, until the connection is closed or bRunning is cleared
+static void echo(UDBus::Connection& connection, const std::atomic<bool>& bRunning) noexcept
+{
+    while (bRunning && connection.read_write(100))
+    {
+        for (auto message = connection.pop_message(); message.is_valid(); message = connection.pop_message())
+        {
+            if (message.get_type() != DBUS_MESSAGE_TYPE_METHOD_CALL)
+                continue;
+
+            UDBus::Message reply;
+            reply.new_method_return(message);
+            DBusMessageIter src, dest;
+            dbus_message_iter_init_append(reply, &dest);
+            if (dbus_message_iter_init(message, &src))
+            {
+                do
+                {
+                    UDBus::Iterator::copy(&src, &dest);
+                } while (dbus_message_iter_next(&src));
+            }
+            connection.send(reply, nullptr);
+        }
+        connection.flush();
+    }
+}
+
+struct ClientResult
+{
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    // The CPU time of the client thread alone, without the echo service
+    std::chrono::microseconds cpu{};
+};
+
+static std::chrono::microseconds threadCPUTime() noexcept
+{
+    rusage usage{};
+    getrusage(RUSAGE_THREAD, &usage);
+    return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static std::chrono::microseconds processCPUTime() noexcept
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// Keeps a window of calls in flight and replaces every completed call with a new one. The echo service replies in
+// order, so collecting the oldest call first does not delay the measurement of the others
+static void drive(const UDBus::Connection& connection, const UDBus::Message& payload, const Options& options, const Clock::time_point end,
+                  UDBus::Histogram& latencies, ClientResult& result) noexcept
+{
+    const auto cpuStart = threadCPUTime();
+    std::vector<UDBus::PendingCall> calls(options.concurrency);
+    std::vector<Clock::time_point> sent(options.concurrency);
+
+    size_t inFlight = 0;
+
+    const auto send = [&](const size_t i) -> void
+    {
+        // Sent messages are locked, so every call sends a fresh copy
+        UDBus::Message message(dbus_message_copy(payload));
+        sent[i] = Clock::now();
+        if (connection.send_with_reply(message, calls[i], DBUS_TIMEOUT_USE_DEFAULT) && static_cast<DBusPendingCall*>(calls[i]) != nullptr)
+            inFlight++;
+        else
+            result.errors++;
+    };
+
+    for (size_t i = 0; i < options.concurrency; i++)
+        send(i);
+    connection.flush();
+
+    for (size_t i = 0; inFlight > 0; i = (i + 1) % options.concurrency)
+    {
+        auto& call = calls[i];
+        if (static_cast<DBusPendingCall*>(call) == nullptr)
+            continue;
+
+        call.block();
+        const auto now = Clock::now();
+        UDBus::Message reply;
+        reply.pending_call_steal_reply(call);
+        call.unref();
+        inFlight--;
+
+        latencies.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent[i]).count());
+        result.calls++;
+        if (!reply.is_valid() || reply.get_type() == DBUS_MESSAGE_TYPE_ERROR)
+            result.errors++;
+
+        // Let the window drain once the time is up
+        if (now < end)
+        {
+            send(i);
+            connection.flush();
+        }
+    }
+    result.cpu = threadCPUTime() - cpuStart;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "Usage: %s [--bus] [--connections <n>] [--concurrency <n>] [--duration <seconds>] [--signature empty|ay|as|a{sv}|a(iiss)] [--size <n>]\n", argv[0]);
+        return 1;
+    }
+
+    UDBus::Message payload;
+    if (!buildPayload(payload, options))
+    {
+        fprintf(stderr, "Unsupported signature: %s\n", options.signature.c_str());
+        return 1;
+    }
+    char* marshalled = nullptr;
+    int payloadSize = 0;
+    if (payload.marshal(&marshalled, &payloadSize))
+        dbus_free(marshalled);
+
+    dbus_threads_init_default();
+    UDBus::Error error;
+    std::atomic<bool> bRunning = true;
+    std::vector<UDBus::Connection> services(options.bBus ? 1 : options.connections);
+    std::vector<std::thread> serviceThreads;
+    UDBus::ConnectionPool clients;
+    UDBus::Server server;
+
+    if (options.bBus)
+    {
+        services[0].bus_get_private(DBUS_BUS_SESSION, error);
+        if (!error.is_set() && services[0].request_name(LOAD_SERVICE_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER && !error.is_set())
+            error.set(DBUS_ERROR_FAILED, "Couldn't own the service name");
+        if (!error.is_set())
+            clients.bus_get_private(DBUS_BUS_SESSION, error, options.connections);
+    }
+    else
+    {
+        server.listen("unix:tmpdir=/tmp", error);
+        if (!error.is_set())
+        {
+            char* address = server.get_address();
+            clients.open_private(address, error, options.connections);
+            dbus_free(address);
+        }
+
+        // Every client connection gets its own peer on the service side
+        for (size_t i = 0; i < options.connections && !error.is_set(); i++)
+        {
+            services[i] = server.accept(5000);
+            if (static_cast<DBusConnection*>(services[i]) == nullptr)
+                error.set(DBUS_ERROR_FAILED, "Couldn't accept a client connection");
+        }
+    }
+
+    if (error.is_set())
+    {
+        fprintf(stderr, "Couldn't set up the echo service: %s\n", error.message());
+        return 1;
+    }
+
+    for (auto& a : services)
+        serviceThreads.emplace_back(echo, std::ref(a), std::cref(bRunning));
+
+    // Every client records into its own histogram, so that they do not contend on the buckets
+    const auto histograms = std::make_unique<UDBus::Histogram[]>(options.connections);
+    std::vector<ClientResult> results(options.connections);
+    std::vector<std::thread> clientThreads;
+
+    const auto cpuStart = processCPUTime();
+    const auto start = Clock::now();
+    for (size_t i = 0; i < options.connections; i++)
+        clientThreads.emplace_back(drive, std::cref(clients.get(i)), std::cref(payload), std::cref(options), start + options.duration, std::ref(histograms[i]), std::ref(results[i]));
+    for (auto& a : clientThreads)
+        a.join();
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto cpu = processCPUTime() - cpuStart;
+
+    bRunning = false;
+    for (auto& a : serviceThreads)
+        a.join();
+    clients.close();
+
+    UDBus::Histogram latencies;
+    for (size_t i = 0; i < options.connections; i++)
+        latencies.merge(histograms[i]);
+
+    ClientResult total;
+    for (const auto& a : results)
+    {
+        total.calls += a.calls;
+        total.errors += a.errors;
+        total.cpu += a.cpu;
+    }
+
+    const auto calls = static_cast<double>(total.calls == 0 ? 1 : total.calls);
+    printf("transport:      %s\n", options.bBus ? "session bus" : "peer-to-peer");
+    printf("payload:        %s, %d bytes marshalled\n", options.signature.c_str(), payloadSize);
+    printf("connections:    %zu x %zu calls in flight\n", options.connections, options.concurrency);
+    printf("calls:          %llu (%llu errors) in %.2fs\n", (unsigned long long)total.calls, (unsigned long long)total.errors, elapsed);
+    printf("throughput:     %.0f calls/s\n", static_cast<double>(total.calls) / elapsed);
+    printf("latency (us):   min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           static_cast<double>(latencies.min()) / 1000.0, static_cast<double>(latencies.percentile(50)) / 1000.0,
+           static_cast<double>(latencies.percentile(90)) / 1000.0, static_cast<double>(latencies.percentile(99)) / 1000.0,
+           static_cast<double>(latencies.percentile(99.9)) / 1000.0, static_cast<double>(latencies.max()) / 1000.0);
+    printf("cpu per call:   %.2fus client, %.2fus process\n", static_cast<double>(total.cpu.count()) / calls, static_cast<double>(cpu.count()) / calls);
+
+    // The full distribution, so that it can be plotted or compared between runs
+    printf("\nlatency distribution (upper bound in us, count, cumulative %%):\n");
+    uint64_t seen = 0;
+    latencies.for_each([&](const uint64_t bound, const uint64_t count) -> void
+    {
+        seen += count;
+        printf("%12.1f %10llu %8.3f\n", static_cast<double>(bound) / 1000.0, (unsigned long long)count, 100.0 * static_cast<double>(seen) / calls);
+    });
+    return total.errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,136 @@
+// Replays a capture against a bus or a peer-to-peer address and reports the throughput and reply latency, to reproduce
+// production traffic against a new build of a service. Captures are pcap files, as written by PcapWriter or
+// dbus-monitor --pcap, or the compact format written by --save.
+//
+// Usage: udbus-replay [options] <capture>
+//   --address <address>   Connect to this address instead of the session bus
+//   --system              Use the system bus instead of the session bus
+//   --destination <name>  Send every message to this name instead of its original destination
+//   --sender <name>       Replay the messages of this sender, e.g. a client in a dbus-monitor capture (default: the
+//                         messages without a sender, which are the ones the capturing connection sent)
+//   --mode <mode>         original, rate or fast (default original)
+//   --speed <factor>      Speeds up original timing, 2 halves the gaps between messages (default 1)
+//   --rate <n>            Messages per second for the rate mode (default 1000)
+//   --window <n>          The maximum number of calls waiting for a reply (default 256)
+//   --timeout <ms>        The reply timeout of every call (default: the libdbus default)
+//   --save <path>         Write the capture in the compact format instead of replaying it
+#include "DBusUtilsStats.hpp"
+#include <cstdio>
+#include <cstring>
+
+struct Options
+{
+    const char* capture = nullptr;
+    const char* address = nullptr;
+    const char* save = nullptr;
+    bool bSystem = false;
+    UDBus::ReplayOptions replay{};
+};
+
+static bool parseOptions(const int argc, char** argv, Options& options) noexcept
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const bool bHasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--address") == 0 && bHasValue)
+            options.address = argv[++i];
+        else if (strcmp(argv[i], "--system") == 0)
+            options.bSystem = true;
+        else if (strcmp(argv[i], "--destination") == 0 && bHasValue)
+            options.replay.destination = argv[++i];
+        else if (strcmp(argv[i], "--sender") == 0 && bHasValue)
+            options.replay.sender = argv[++i];
+        else if (strcmp(argv[i], "--mode") == 0 && bHasValue)
+        {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "original") == 0)
+                options.replay.timing = UDBus::REPLAY_ORIGINAL;
+            else if (strcmp(mode, "rate") == 0)
+                options.replay.timing = UDBus::REPLAY_FIXED_RATE;
+            else if (strcmp(mode, "fast") == 0)
+                options.replay.timing = UDBus::REPLAY_AS_FAST_AS_POSSIBLE;
+            else
+                return false;
+        }
+        else if (strcmp(argv[i], "--speed") == 0 && bHasValue)
+            options.replay.speed = strtod(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--rate") == 0 && bHasValue)
+            options.replay.rate = strtod(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--window") == 0 && bHasValue)
+            options.replay.window = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--timeout") == 0 && bHasValue)
+            options.replay.timeoutMilliseconds = static_cast<int>(strtol(argv[++i], nullptr, 10));
+        else if (strcmp(argv[i], "--save") == 0 && bHasValue)
+            options.save = argv[++i];
+        else if (argv[i][0] != '-' && options.capture == nullptr)
+            options.capture = argv[i];
+        else
+            return false;
+    }
+    return options.capture != nullptr && options.replay.speed > 0 && options.replay.rate > 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "Usage: %s [--address <address> | --system] [--destination <name>] [--sender <name>] [--mode original|rate|fast] [--speed <factor>] "
+                        "[--rate <n>] [--window <n>] [--timeout <ms>] [--save <path>] <capture>\n", argv[0]);
+        return 1;
+    }
+
+    UDBus::Error error;
+    UDBus::Replay replay;
+    if (!replay.load(options.capture, error))
+    {
+        fprintf(stderr, "Couldn't load %s: %s\n", options.capture, error.message());
+        return 1;
+    }
+
+    if (options.save != nullptr)
+    {
+        if (!replay.save(options.save, error))
+        {
+            fprintf(stderr, "Couldn't save %s: %s\n", options.save, error.message());
+            return 1;
+        }
+        printf("saved %zu messages to %s\n", replay.size(), options.save);
+        return 0;
+    }
+
+    UDBus::Connection connection;
+    if (options.address != nullptr)
+        connection.open_private(options.address, error);
+    else
+        connection.bus_get_private(options.bSystem ? DBUS_BUS_SYSTEM : DBUS_BUS_SESSION, error);
+    if (error.is_set())
+    {
+        fprintf(stderr, "Couldn't connect: %s\n", error.message());
+        return 1;
+    }
+
+    UDBus::ReplayResult result;
+    const bool bCompleted = replay.run(connection, options.replay, result, error);
+    connection.close();
+
+    static const char* modes[] = { "original timing", "fixed rate", "as fast as possible" };
+    const auto elapsed = std::chrono::duration<double>(result.elapsed).count();
+    const auto& latency = result.latency;
+    printf("capture:        %s, %zu messages\n", options.capture, replay.size());
+    printf("mode:           %s\n", modes[options.replay.timing]);
+    printf("sent:           %llu (%llu skipped) in %.2fs\n", (unsigned long long)result.sent, (unsigned long long)result.skipped, elapsed);
+    printf("replies:        %llu (%llu errors)\n", (unsigned long long)result.replies, (unsigned long long)result.errors);
+    printf("throughput:     %.0f messages/s\n", elapsed > 0 ? static_cast<double>(result.sent) / elapsed : 0.0);
+    printf("latency (us):   min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           static_cast<double>(latency.min()) / 1000.0, static_cast<double>(latency.percentile(50)) / 1000.0,
+           static_cast<double>(latency.percentile(90)) / 1000.0, static_cast<double>(latency.percentile(99)) / 1000.0,
+           static_cast<double>(latency.percentile(99.9)) / 1000.0, static_cast<double>(latency.max()) / 1000.0);
+
+    if (!bCompleted)
+    {
+        fprintf(stderr, "The replay stopped early: %s\n", error.message());
+        return 1;
+    }
+    return result.errors == 0 ? 0 : 2;
+}